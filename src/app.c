@@ -24,8 +24,6 @@
 #include "mi_beacon.h"
 #endif
 
-void app_enter_ota_mode(void);
-
 RAM lcd_flg_t lcd_flg;
 
 RAM measured_data_t measured_data;
@@ -57,7 +55,6 @@ const scomfort_t def_cmf = {
 // Settings
 const cfg_t def_cfg = {
 		.flg.temp_F_or_C = false,
-		.flg.comfort_smiley = true,
 		.flg2.smiley = 0, // 0 = "     " off
 		.flg.blinking_time_smile = false,
 		.flg.show_batt_enabled = false,
@@ -89,7 +86,11 @@ const cfg_t def_cfg = {
 #endif
 #endif
 		.rf_tx_power = RF_POWER_P0p04dBm, // RF_POWER_P3p01dBm,
-		.connect_latency = 124 // (124+1)*1.25*16 = 2500 ms
+		.connect_latency = 124, // (124+1)*1.25*16 = 2500 ms
+		.event_adv_cnt = 0, // off
+		.adv_weights = ADV_WEIGHTS_DEFAULT,
+		.scan_rsp = 0, // device name only
+		.conn_window = 0 // off
 		};
 RAM cfg_t cfg;
 static const external_data_t def_ext = {
@@ -106,21 +107,40 @@ RAM external_data_t ext;
 RAM uint32_t pincode;
 #endif
 
-__attribute__((optimize("-Os"))) void test_config(void) {
-	if(cfg.rf_tx_power &BIT(7)) {
-		if (cfg.rf_tx_power < RF_POWER_N25p18dBm)
-			cfg.rf_tx_power = RF_POWER_N25p18dBm;
-		else if (cfg.rf_tx_power > RF_POWER_P3p01dBm)
-			cfg.rf_tx_power = RF_POWER_P3p01dBm;
-	} else { if (cfg.rf_tx_power < RF_POWER_P3p23dBm)
-		cfg.rf_tx_power = RF_POWER_P3p23dBm;
-	else if (cfg.rf_tx_power > RF_POWER_P10p46dBm)
-		cfg.rf_tx_power = RF_POWER_P10p46dBm;
+static uint8_t test_rf_power(uint8_t level) {
+	if(level & BIT(7)) {
+		if (level < RF_POWER_N25p18dBm)
+			level = RF_POWER_N25p18dBm;
+		else if (level > RF_POWER_P3p01dBm)
+			level = RF_POWER_P3p01dBm;
+	} else { if (level < RF_POWER_P3p23dBm)
+		level = RF_POWER_P3p23dBm;
+	else if (level > RF_POWER_P10p46dBm)
+		level = RF_POWER_P10p46dBm;
 	}
+	return level;
+}
+
+/* A config of the version 3.5 size (a Flash record or a write of an older tool):
+ * bit 2 of flg was comfort_smiley, advertising_type had 2 bits */
+void test_config_v35(uint32_t len) {
+	if (len <= FEEP_MIN_SIZE_CFG)
+		cfg.flg.advertising_type &= 3;
+}
+
+__attribute__((optimize("-Os"))) void test_config(void) {
+	cfg.rf_tx_power = test_rf_power(cfg.rf_tx_power);
+	if (cfg.rf_tx_power_conn)
+		cfg.rf_tx_power_conn = test_rf_power(cfg.rf_tx_power_conn);
+	tx_power_adv = cfg.rf_tx_power; // restart the adaptive TX power
 	if (cfg.measure_interval == 0)
 		cfg.measure_interval = 1; // T = cfg.measure_interval * advertising_interval_ms (ms),  Tmin = 1 * 1*62.5 = 62.5 ms / 1 * 160 * 62.5 = 10000 ms
 	else if (cfg.measure_interval > 25) // max = (0x100000000-1.5*10000000*16)/(10000000*16) = 25.3435456
 		cfg.measure_interval = 25; // T = cfg.measure_interval * advertising_interval_ms (ms),  Tmax = 25 * 160*62.5 = 250000 ms = 250 sec
+	if (cfg.flg.advertising_type > ADV_TYPE_BTHOME)
+		cfg.flg.advertising_type = ADV_TYPE_DEFAULT;
+	if (cfg.adv_weights == 0) // all formats off?
+		cfg.adv_weights = ADV_WEIGHTS_DEFAULT;
 	if (cfg.flg.tx_measures)
 		tx_measures = 0xff; // always notify
 	if (cfg.advertising_interval == 0) // 0 ?
@@ -188,8 +208,14 @@ void user_init_normal(void) {//this will get executed one time after power up
 	random_generator_init(); //must
 	// Read config
 	if (flash_supported_eep_ver(EEP_SUP_VER, VERSION)) {
-		if(flash_read_cfg(&cfg, EEP_ID_CFG, sizeof(cfg)) != sizeof(cfg))
-			memcpy(&cfg, &def_cfg, sizeof(cfg));
+		memcpy(&cfg, &def_cfg, sizeof(cfg)); // fields missing in a saved config keep defaults
+		if(flash_read_cfg(&cfg, EEP_ID_CFG, sizeof(cfg)) < FEEP_MIN_SIZE_CFG) {
+			// version 3.5 config: bit2 of flg was comfort_smiley
+			if(flash_read_cfg(&cfg, EEP_ID_CFG_V35, sizeof(cfg)) == FEEP_MIN_SIZE_CFG)
+				test_config_v35(FEEP_MIN_SIZE_CFG);
+			else
+				memcpy(&cfg, &def_cfg, sizeof(cfg));
+		}
 		if(flash_read_cfg(&cmf, EEP_ID_CMF, sizeof(cmf)) != sizeof(cmf))
 			memcpy(&cmf, &def_cmf, sizeof(cmf));
 #if USE_TIME_ADJUST
@@ -229,9 +255,40 @@ void user_init_normal(void) {//this will get executed one time after power up
 _attribute_ram_code_ void user_init_deepRetn(void) {//after sleep this will get executed
 //	adv_mi_count++;
 	blc_ll_initBasicMCU();
-	rf_set_power_level_index(cfg.rf_tx_power);
+	rf_set_power_level_index(ble_tx_power());
 	blc_ll_recoverDeepRetention();
-	bls_ota_registerStartCmdCb(app_enter_ota_mode);
+	pm_stat_wakeup(1);
+	ota_callbacks_init();
+}
+
+#define EVENT_TEMP_DELTA	50 // x0.01 C, temperature change between two measurements that starts an advertising burst
+static RAM uint8_t event_init; // event_temp and event_trg_flg hold a measurement
+static RAM int16_t event_temp; // temperature of the previous measurement, x0.01 C
+#if USE_TRIGGER_OUT
+static RAM uint8_t event_trg_flg; // trigger flags of the previous measurement
+#endif
+
+// Significant event for an advertising burst: trigger flags flip or a sharp temperature change
+_attribute_ram_code_ static bool test_adv_event(void) {
+	bool event = false;
+	int16_t delta = measured_data.temp - event_temp;
+	event_temp = measured_data.temp;
+	if (!event_init) { // the first measurement after boot only seeds the values
+		event_init = 1;
+#if USE_TRIGGER_OUT
+		event_trg_flg = trg.flg_byte;
+#endif
+		return false;
+	}
+	if (delta >= EVENT_TEMP_DELTA || delta <= -EVENT_TEMP_DELTA)
+		event = true;
+#if USE_TRIGGER_OUT
+	if (trg.flg_byte != event_trg_flg) {
+		event_trg_flg = trg.flg_byte;
+		event = true;
+	}
+#endif
+	return event;
 }
 
 //----------------------- main_loop()
@@ -245,14 +302,27 @@ _attribute_ram_code_ void main_loop(void) {
 		utc_time_sec++; // + 1 sec
 	}
 
+	ble_transfer_poll();
 	// Do not do anything else if we are upgrading the firmware
 	if (ota_is_working) {
 		bls_pm_setSuspendMask(SUSPEND_ADV | SUSPEND_CONN); // SUSPEND_DISABLE
 		bls_pm_setManualLatency(0);
+		ota_stat_poll();
 		return;
 	}
 
+	if (cmd_queue_poll()) {
+		if (cmd_pending)
+			uclock_awake_after(0); // a long command in steps, do not sleep
+		else
+			bls_pm_setManualLatency(0); // the next commands at the next connection event
+	}
 	button_handle();
+	ble_phy_update();
+#if USE_EXT_ADV
+	ext_adv_poll();
+#endif
+	conn_window_poll();
 	if (sensor_read()) {
 		last_temp = (measured_data.temp + 5)/ 10;
 		last_humi = (measured_data.humi + 50)/ 100;
@@ -267,8 +337,16 @@ _attribute_ram_code_ void main_loop(void) {
 			mi_beacon_summ();
 #endif
 		set_adv_data();
+		adv_history_add();
+		all_values_update();
+		scan_rsp_measure();
+		tx_power_measure();
+		if (test_adv_event())
+			ble_event_adv();
 		display_update();
 		uclock_awake_after(0); // Ensure that we do not sleep after measuring new data
+	} else if (sensor_fault_changed()) {
+		set_adv_data(); // advertise the sensor fault flag
 	} else if (sensor_is_idle()) {
 		if ((blc_ll_getCurrentState() & BLS_LINK_STATE_CONN)) {
 			if (blc_ll_getTxFifoNumber() < 9) {
@@ -286,28 +364,39 @@ _attribute_ram_code_ void main_loop(void) {
 							ble_send_lcd();
 						}
 					}
-					if (batteryValueInCCC[0] | batteryValueInCCC[1])
-						ble_send_battery();
-					if (tempValueInCCC[0] | tempValueInCCC[1])
-						ble_send_temp();
-					if (temp2ValueInCCC[0] | temp2ValueInCCC[1])
-						ble_send_temp2();
-					if (humiValueInCCC[0] | humiValueInCCC[1])
-						ble_send_humi();
+					if (allValueInCCC[0] | allValueInCCC[1]) // one notification instead of four
+						ble_send_all();
+					else {
+						if (batteryValueInCCC[0] | batteryValueInCCC[1])
+							ble_send_battery();
+						if ((tempValueInCCC[0] | tempValueInCCC[1]) && ess_trg_test(ESS_TRG_TEMP, last_temp))
+							ble_send_temp();
+						if ((temp2ValueInCCC[0] | temp2ValueInCCC[1]) && ess_trg_test(ESS_TRG_TEMP2, measured_data.temp))
+							ble_send_temp2();
+						if ((humiValueInCCC[0] | humiValueInCCC[1]) && ess_trg_test(ESS_TRG_HUMI, measured_data.humi))
+							ble_send_humi();
+					}
 				} else if (mi_key_stage) {
 					mi_key_stage = get_mi_keys(mi_key_stage);
+					if (!mi_key_stage)
+						ble_transfer_end(TRANSFER_KEYS);
 		#if USE_FLASH_MEMO
 				} else if (rd_memo.cnt) {
-					send_memo_blk();
+					do { // fill the TX FIFO for the next connection event
+						send_memo_blk();
+					} while (rd_memo.cnt && blc_ll_getTxFifoNumber() < 9);
 		#endif
 				}
 			}
 			if (last_reported_measure_count != measured_data.count || mi_key_stage || rd_memo.cnt) {
-				uclock_awake_after(62500); // If there are updates pendings, sleep for 62.5 ms
+				// If there are updates pending, wake up at the next connection event
+				// (the data goes out only in connection events) instead of a timer
+				bls_pm_setManualLatency(0);
 			}
 		}
 					
 		display_async_refresh();
 	}
 	uclock_before_sleep();
+	pm_stat_sleep();
 }
@@ -8,7 +8,8 @@
 #ifndef MAIN_H_
 #define MAIN_H_
 
-#define EEP_ID_CFG (0x0CFC) // EEP ID config data
+#define EEP_ID_CFG (0x0CFD) // EEP ID config data
+#define EEP_ID_CFG_V35 (0x0CFC) // EEP ID config data, version 3.5 and older (2-bit advertising_type)
 #define EEP_ID_TRG (0x0DFE) // EEP ID trigger data
 #define EEP_ID_PCD (0xC0DE) // EEP ID pincode
 #define EEP_ID_CMF (0x0FCC) // EEP ID comfort data
@@ -21,16 +22,17 @@ enum {
 	ADV_TYPE_ATC = 0,
 	ADV_TYPE_PVVX, // (default)
 	ADV_TYPE_MI,
-	ADV_TYPE_ALL
+	ADV_TYPE_ALL,
+	ADV_TYPE_BTHOME
 } ADV_TYPE_ENUM;
 
 #define ADV_TYPE_MASK_REF		2 // advertising_type & ADV_TYPE_MASK_REF = ADV_TYPE_MI, ADV_TYPE_ALL -> refresh all beacon -> set_adv_data() in main cycle
 #define ADV_TYPE_DEFAULT	ADV_TYPE_PVVX
+#define ADV_WEIGHTS_DEFAULT	0x25 // atc1441:pvvx:Mi:BTHome = 1:1:2:0
 
 typedef struct __attribute__((packed)) _cfg_t {
 	struct __attribute__((packed)) {
-		uint8_t advertising_type	: 2; // 0 - atc1441, 1 - Custom (pvvx), 2 - Mi, 3 - all
-		uint8_t comfort_smiley		: 1; // unused
+		uint8_t advertising_type	: 3; // 0 - atc1441, 1 - Custom (pvvx), 2 - Mi, 3 - all, 4 - BTHome v2
 		uint8_t blinking_time_smile	: 1; // unused
 		uint8_t temp_F_or_C			: 1;
 		uint8_t show_batt_enabled	: 1;
@@ -61,7 +63,8 @@ typedef struct __attribute__((packed)) _cfg_t {
 		uint8_t smiley 		: 3;	// 0..7
 		uint8_t mi_beacon  	: 1; 	// advertising uses crypto beacon
 		uint8_t adv_flags  	: 1; 	// advertising add flags
-		uint8_t reserved	: 3;
+		uint8_t oversampling: 2;	// sensor conversions averaged per reading: 0 - 1, 1 - 2, 2 - 4, 3 - 8
+		uint8_t adv_history	: 1;	// custom advertising carries the previous readings
 	} flg2;
 	int8_t temp_offset; // Set temp offset, -12,5 - +12,5 °C (-125..125)
 	int8_t humi_offset; // Set humi offset, -12,5 - +12,5 % (-125..125)
@@ -79,7 +82,18 @@ typedef struct __attribute__((packed)) _cfg_t {
 		uint8_t shtc3		: 1; // =1 - sensor SHTC3, = 0 - sensor SHT4x
 	} hw_cfg; // read only
 	uint8_t averaging_measurements; // * measure_interval, 0 - off, 1..255 * measure_interval
+	uint8_t event_adv_cnt; // advertising packets sent at a short interval after an event, 0 - off
+	uint8_t adv_weights; // ADV_TYPE_ALL slot weights 0..3, 2 bits per format: bit0..1 - atc1441, bit2..3 - pvvx, bit4..5 - Mi, bit6..7 - BTHome
+	uint8_t scan_rsp; // scan response items (SCAN_RSP_*), 0 - device name only
+	struct __attribute__((packed)) {
+		uint8_t adv_phy		: 2; // advertising: 0 - legacy 1M, 1 - extended 1M/2M, 2 - extended Coded S2, 3 - extended Coded S8 (after reboot)
+		uint8_t conn_phy	: 2; // connection: 0 - 1M, 1 - 2M, 2 - Coded S2, 3 - Coded S8 (if supported by the central)
+		uint8_t tx_margin	: 4; // adaptive TX power: link margin x2 dB (command 0x3A), 0 - off
+	} flg3;
+	uint8_t rf_tx_power_conn; // TX power in connection (as rf_tx_power), 0 - as advertising
+	uint8_t conn_window; // period of the scheduled connectable window, minutes (on UTC time), 0 - off
 }cfg_t;
+#define FEEP_MIN_SIZE_CFG	11 // size of the version 3.5 config, the newer fields are appended and default if not saved
 extern cfg_t cfg;
 extern const cfg_t def_cfg;
 /* Warning: MHO-C401 Symbols: "%", "°Г", "(  )", "." have one control bit! */
@@ -164,6 +178,7 @@ extern uint32_t connection_timeout;
 extern uint32_t measurement_step_time;
 void ev_adv_timeout(u8 e, u8 *p, int n);
 void test_config(void);
+void test_config_v35(uint32_t len);
 void reset_cache(void);
 
 void blc_newMacAddress(int flash_addr, u8 *mac_pub, u8 *mac_rand);
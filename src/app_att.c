@@ -119,20 +119,24 @@ static const u16 my_tempServiceUUID       = 0x181A;
 static const u16 my_tempCharUUID       	  = 0x2A1F; //
 static const u16 my_temp2CharUUID      	  = 0x2A6E; // https://github.com/oesmith/gatt-xml/blob/master/org.bluetooth.characteristic.temperature.xml
 static const u16 my_humiCharUUID       	  = 0x2A6F; // https://github.com/oesmith/gatt-xml/blob/master/org.bluetooth.characteristic.humidity.xml
+static const u16 my_allCharUUID       	  = 0x1F1A; // all values: all_values_t
 RAM u8 tempValueInCCC[2];
 RAM u8 temp2ValueInCCC[2];
 RAM u8 humiValueInCCC[2];
+RAM u8 allValueInCCC[2];
 
 /////////////////////////////////////////////////////////
 static const  u8 my_OtaUUID[16]					    = TELINK_SPP_DATA_OTA;
 static const  u8 my_OtaServiceUUID[16]				= TELINK_OTA_UUID_SERVICE;
 static u8 my_OtaData 						        = 0x00;
 static const u8  my_OtaName[] = {'O', 'T', 'A'};
+static const u16 my_OtaStatUUID				= 0x1F1B; // OTA progress: ota_stat_t
+RAM u8 otaStatCCC[2];
 
 // RxTx Char
 static const  u16 my_RxTxUUID				= 0x1f1f;
 static const  u16 my_RxTx_ServiceUUID		= 0x1f10;
-RAM u8 my_RxTx_Data[16];
+RAM u8 my_RxTx_Data[sizeof(cfg_t) + 3];
 RAM u8 RxTxValueInCCC[2];
 
 //0x95FE
@@ -190,6 +194,20 @@ static const u8 my_humiCharVal[5] = {
 	U16_LO(0x2A6F), U16_HI(0x2A6F)
 };
 
+//// All values attribute values
+static const u8 my_allCharVal[5] = {
+	CHAR_PROP_READ | CHAR_PROP_NOTIFY,
+	U16_LO(ALL_VALUES_DP_H), U16_HI(ALL_VALUES_DP_H),
+	U16_LO(0x1F1A), U16_HI(0x1F1A)
+};
+
+//// OTA progress attribute values
+static const u8 my_OtaStatCharVal[5] = {
+	CHAR_PROP_READ | CHAR_PROP_NOTIFY,
+	U16_LO(OTA_STAT_DP_H), U16_HI(OTA_STAT_DP_H),
+	U16_LO(0x1F1B), U16_HI(0x1F1B)
+};
+
 //// OTA attribute values
 #define TELINK_SPP_DATA_OTA1 				0x12,0x2B,0x0d,0x0c,0x0b,0x0a,0x09,0x08,0x07,0x06,0x05,0x04,0x03,0x02,0x01,0x00
 static const u8 my_OtaCharVal[19] = {
@@ -350,6 +368,7 @@ RAM attribute_t my_Attributes[] = {
 		{0,ATT_PERMISSIONS_READ,2,sizeof(my_humiCharVal),(u8*)(&my_characterUUID), (u8*)(my_humiCharVal), 0},				//prop
 		{0,ATT_PERMISSIONS_READ,2,sizeof(measured_data.humi),(u8*)(&my_humiCharUUID), 	(u8*)(&measured_data.humi), 0},	//value
 		{0,ATT_PERMISSIONS_RDWR,2,sizeof(humiValueInCCC),(u8*)(&clientCharacterCfgUUID), 	(u8*)(humiValueInCCC), 0},	//value
+
 	////////////////////////////////////// OTA /////////////////////////////////////////////////////
 	//
 	{4,ATT_PERMISSIONS_READ, 2,16,(u8*)(&my_primaryServiceUUID), (u8*)(&my_OtaServiceUUID), 0},
@@ -358,10 +377,17 @@ RAM attribute_t my_Attributes[] = {
 		{0,ATT_PERMISSIONS_READ, 2,sizeof (my_OtaName),(u8*)(&userdesc_UUID), (u8*)(my_OtaName), 0},
 	////////////////////////////////////// RxTx ////////////////////////////////////////////////////
 	// RxTx Communication
-	{4,ATT_PERMISSIONS_READ,2,2,(u8*)(&my_primaryServiceUUID), 	(u8*)(&my_RxTx_ServiceUUID), 0},
+	{10,ATT_PERMISSIONS_READ,2,2,(u8*)(&my_primaryServiceUUID), 	(u8*)(&my_RxTx_ServiceUUID), 0},
 		{0,ATT_PERMISSIONS_READ, 2,sizeof(my_RxTxCharVal),(u8*)(&my_characterUUID),	(u8*)(my_RxTxCharVal), 0},				//prop
 		{0,ATT_PERMISSIONS_RDWR, 2,sizeof(my_RxTx_Data),(u8*)(&my_RxTxUUID), (u8*)&my_RxTx_Data, &RxTxWrite, 0},
 		{0,ATT_PERMISSIONS_RDWR, 2,sizeof(RxTxValueInCCC),(u8*)(&clientCharacterCfgUUID), 	(u8*)(RxTxValueInCCC), 0},	//value
+		// new characteristics are appended here, so that the older handles stay
+		{0,ATT_PERMISSIONS_READ,2,sizeof(my_allCharVal),(u8*)(&my_characterUUID), (u8*)(my_allCharVal), 0},				//prop
+		{0,ATT_PERMISSIONS_READ,2,sizeof(all_values),(u8*)(&my_allCharUUID), 	(u8*)(&all_values), 0},	//value
+		{0,ATT_PERMISSIONS_RDWR,2,sizeof(allValueInCCC),(u8*)(&clientCharacterCfgUUID), 	(u8*)(allValueInCCC), 0},	//value
+		{0,ATT_PERMISSIONS_READ, 2,sizeof(my_OtaStatCharVal),(u8*)(&my_characterUUID), (u8*)(my_OtaStatCharVal), 0},				//prop
+		{0,ATT_PERMISSIONS_READ, 2,sizeof(ota_stat),(u8*)(&my_OtaStatUUID), (u8*)(&ota_stat), 0},	//value
+		{0,ATT_PERMISSIONS_RDWR, 2,sizeof(otaStatCCC),(u8*)(&clientCharacterCfgUUID), (u8*)(otaStatCCC), 0},	//value
 #if USE_MIHOME_SERVICE
 	///////////////////////////////////MI_SERVICE//////////////////////////////////////////////////
 	{20,ATT_PERMISSIONS_AUTHOR_READ, 2,2,(u8*)(&my_primaryServiceUUID),	(u8*)(&mi_primary_service_uuid), 0}, // 0xFE95 service uuid
@@ -4,7 +4,7 @@
 extern "C" {
 #endif
 
-#define VERSION 0x35	 // BCD format (0x34 -> '3.4')
+#define VERSION 0x36	 // BCD format (0x34 -> '3.4')
 #define EEP_SUP_VER 0x09 // EEP data minimum supported version
 
 #define DEVICE_CGG1 		0x0B48  // E-Ink display CGG1-M "Qingping Temp & RH Monitor"
@@ -29,6 +29,7 @@ extern "C" {
 #define USE_MIHOME_SERVICE			0 // = 1 MiHome service compatibility (missing in current version! Set = 0!)
 #define USE_MIHOME_BEACON			1 // = 1 Compatible with MiHome beacon encryption
 #define USE_NEW_OTA					0 // = 1 keeping the old firmware, erasing the region when updating (test version only!)
+#define USE_EXT_ADV					1 // = 1 extended advertising option (2M / Coded PHY, cfg.flg3.adv_phy)
 
 #if DEVICE_TYPE == DEVICE_CGG1
 
@@ -94,6 +95,9 @@ extern "C" {
 #define PD7_OUTPUT_ENABLE	1
 #define PD7_FUNC			AS_GPIO
 
+#define USE_EPD_SPI			1 // = 1 EPD data bits are clocked by the SPI master (PB7 - SDO, PD7 - CK), = 0 bit-bang
+#define EPD_SPI_CLK			1000000 // SPI master clock, Hz
+
 // PC4 - key
 #define GPIO_KEY			GPIO_PC4
 #define PC4_INPUT_ENABLE	1
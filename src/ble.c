@@ -10,6 +10,7 @@
 #include "app.h"
 #include "display.h"
 #include "flash_eep.h"
+#include "uclock.h"
 #if	USE_TRIGGER_OUT
 #include "trigger.h"
 #endif
@@ -19,10 +20,11 @@
 #if USE_MIHOME_BEACON
 #include "mi_beacon.h"
 #endif
+#include "bthome_beacon.h"
 
 void bls_set_advertise_prepare(void *p); // add ll_adv.h
 
-RAM uint8_t ble_connected; // bit 0 - connected, bit 1 - conn_param_update, bit 2 - paring success, bit 7 - reset of disconnect
+RAM uint8_t ble_connected; // bit 0 - connected, bit 1 - conn_param_update, bit 2 - paring success, bit 4 - connectable mode, bit 5 - connectable window, bit 7 - reset of disconnect
 uint8_t send_buf[SEND_BUFFER_SIZE];
 
 RAM uint8_t blt_rxfifo_b[64 * 8] = { 0 };
@@ -42,52 +44,163 @@ RAM uint8_t mac_random_static[6];
 RAM uint32_t adv_send_count;
 RAM uint32_t adv_old_count;
 RAM adv_buf_t adv_buf;
+RAM adv_stat_t adv_stat;
+static RAM uint8_t adv_fmt; // format of the current advertising data, index in adv_stat.packets[]
+static RAM int8_t adv_wrr[ADV_FMT_NUM]; // ADV_TYPE_ALL scheduler: current slot weights
+#if USE_EXT_ADV
+RAM uint8_t ext_adv_phy; // cfg.flg3.adv_phy at boot, 0 - legacy advertising
+static RAM uint32_t ext_adv_end_tick; // end of the timed advertising (clock_time() | 1), 0 - none
+static RAM uint8_t ext_adv_set_param[ADV_SET_PARAM_LENGTH];
+static RAM uint8_t ext_adv_pri_pkt[MAX_LENGTH_PRIMARY_ADV_PKT];
+static RAM uint8_t ext_adv_sec_pkt[MAX_LENGTH_SECOND_ADV_PKT];
+static RAM uint8_t ext_adv_data[ADV_BUFFER_SIZE + 3];
+static RAM uint8_t ext_scan_rsp_data[sizeof(ble_name)];
+#endif
+static RAM uint8_t scan_rsp_len; // size of the scan response in ble_name[]
+static RAM uint32_t phy_req_tick; // connection PHY request pending (clock_time() | 1), 0 - none
+static RAM uint32_t transfer_tick; // time accounting of transfer_stat, clock_time()
+static RAM uint32_t transfer_cur_ms; // duration of the current transfer, ms
+RAM transfer_stat_t transfer_stat;
+static RAM uint32_t pm_sleep_tick; // sleep start, clock_time() | 1, 0 - awake
+static RAM uint16_t pm_suspend_us, pm_retention_us; // remainders of pm_stat, us
+RAM pm_stat_t pm_stat;
 uint8_t ota_is_working = 0;
+RAM ota_stat_t ota_stat;
+static RAM uint32_t ota_start_tick; // OTA start, clock_time()
+static RAM uint32_t ota_notify_tick; // last OTA progress notification, clock_time()
 
+/* OTA fast path: the transfer connection parameters (ble_transfer_start())
+ * and the largest MTU, so that a write can carry several OTA PDUs */
 void app_enter_ota_mode(void) {
-#if USE_NEW_OTA
-	bls_ota_clearNewFwDataArea();
+	if(ota_resume.state != OTA_RESUME_READY) { // new OTA
+#if USE_NEW_OTA == 0
+		if(ota_resume.index) // data of an interrupted OTA
 #endif
+			bls_ota_clearNewFwDataArea();
+		ota_resume.state = OTA_RESUME_NONE;
+		ota_resume.index = 0;
+		ota_resume.crc = 0xffffffff;
+	}
 	ota_is_working = 1;
+	memset(&ota_stat, 0, sizeof(ota_stat));
+	ota_stat.state = 1;
+	ota_start_tick = clock_time();
+	ota_notify_tick = ota_start_tick;
+	ble_transfer_start(TRANSFER_OTA);
+	if(blc_att_getEffectiveMtuSize(BLS_CONN_HANDLE) < ATT_MTU_MAX_SIZE)
+		blc_att_requestMtuSizeExchange(BLS_CONN_HANDLE, ATT_MTU_MAX_SIZE);
 	bls_ota_setTimeout(45 * 1000000); // set OTA timeout  45 seconds
 }
 
-#define BLE_ADV_TIME 0 // Test Only!
-#if BLE_ADV_TIME
-typedef struct __attribute__((packed)) _resp_time_t {
+/* Scan response: the device name and the items enabled in cfg.scan_rsp,
+ * built in ble_name[] (see SCAN_RSP_* in ble.h) */
+typedef struct __attribute__((packed)) _scan_rsp_head_t {
 	uint8_t len;
-	uint8_t type;
-	uint16_t uuid;
-	uint32_t utime;
-}resp_time_t, * presp_time_t;
-
-void add_resp_time() {
-	uint8_t len = ble_name[0];
-	presp_time_t p;
-	if (len < (sizeof(ble_name)-1-sizeof(resp_time_t))) {
-		p = (presp_time_t) &ble_name[len+1];
-		p->len = sizeof(resp_time_t) - 1;
-		p->type = 0x16;
-		p->uuid = 0x1f11;
-		p->utime = utc_time_sec;
-	} else
-		ble_name[len+1] = 0;
+	uint8_t type;	// = 0x16, 16-bit UUID
+	uint16_t uuid;	// = 0x1F11
+	uint8_t items;	// SCAN_RSP_* items included
+}scan_rsp_head_t, * pscan_rsp_head_t;
+
+static RAM int16_t scan_temp_min, scan_temp_max; // x0.01 C
+static RAM uint16_t scan_humi_min, scan_humi_max; // x0.01 %
+static RAM uint8_t scan_minmax_cnt; // measurements since the previous scan response
+
+// Min/max of the measurements since the previous scan response, called once per new measurement
+_attribute_ram_code_ void scan_rsp_measure(void) {
+	if(scan_minmax_cnt == 0 || measured_data.temp < scan_temp_min)
+		scan_temp_min = measured_data.temp;
+	if(scan_minmax_cnt == 0 || measured_data.temp > scan_temp_max)
+		scan_temp_max = measured_data.temp;
+	if(scan_minmax_cnt == 0 || measured_data.humi < scan_humi_min)
+		scan_humi_min = measured_data.humi;
+	if(scan_minmax_cnt == 0 || measured_data.humi > scan_humi_max)
+		scan_humi_max = measured_data.humi;
+	scan_minmax_cnt = 1;
 }
-void ble_scan_response_callback(uint8_t e, uint8_t *p, int n) {
-	add_resp_time();
-	bls_ll_setScanRspData((uint8_t *) ble_name, ble_name[0] + 1 + ble_name[ble_name[0]+1] + 1);
+
+static uint8_t * scan_rsp_add(uint8_t * p, void * data, uint8_t size) {
+	memcpy(p, data, size);
+	return p + size;
 }
+
+// Builds the scan response in ble_name[] and passes it to the link layer
+_attribute_ram_code_ __attribute__((optimize("-Os")))
+void ble_set_scan_rsp(void) {
+	uint8_t len = ble_name[0] + 1;
+	uint8_t * pend = &ble_name[(sizeof(ble_name) < 31)? sizeof(ble_name) : 31];
+	pscan_rsp_head_t ph = (pscan_rsp_head_t) &ble_name[len];
+	uint8_t * p = (uint8_t *)ph + sizeof(scan_rsp_head_t);
+	uint8_t items = cfg.scan_rsp;
+	if(items && p <= pend) {
+		ph->items = 0;
+		if((items & SCAN_RSP_TIME) && p + 4 <= pend) {
+			p = scan_rsp_add(p, &utc_time_sec, 4);
+			ph->items |= SCAN_RSP_TIME;
+		}
+		if((items & SCAN_RSP_MINMAX) && p + 8 <= pend) {
+			if(scan_minmax_cnt == 0) // no new measurements
+				scan_rsp_measure();
+			p = scan_rsp_add(p, &scan_temp_min, 2);
+			p = scan_rsp_add(p, &scan_temp_max, 2);
+			p = scan_rsp_add(p, &scan_humi_min, 2);
+			p = scan_rsp_add(p, &scan_humi_max, 2);
+			scan_minmax_cnt = 0;
+			ph->items |= SCAN_RSP_MINMAX;
+		}
+		if((items & SCAN_RSP_BATT) && p + 2 <= pend) {
+			p = scan_rsp_add(p, &measured_data.battery_mv, 2);
+			ph->items |= SCAN_RSP_BATT;
+		}
+		if((items & SCAN_RSP_VER) && p + 2 <= pend) {
+			uint8_t i, sum = 0;
+			for(i = 0; i < sizeof(cfg); i++)
+				sum += ((uint8_t *)&cfg)[i];
+			*p++ = VERSION;
+			*p++ = sum; // config checksum
+			ph->items |= SCAN_RSP_VER;
+		}
+#if USE_FLASH_MEMO
+		if((items & SCAN_RSP_MEMO) && p + 2 <= pend) {
+			uint16_t pos = get_memo_position();
+			p = scan_rsp_add(p, &pos, 2);
+			ph->items |= SCAN_RSP_MEMO;
+		}
+#endif
+		ph->len = p - (uint8_t *)ph - 1;
+		ph->type = GAP_ADTYPE_SERVICE_DATA_UUID_16BIT;
+		ph->uuid = 0x1f11;
+		len = p - ble_name;
+	}
+	scan_rsp_len = len;
+#if USE_EXT_ADV
+	if(ext_adv_phy)
+		blc_ll_setExtScanRspData(ADV_HANDLE0, DATA_OPER_COMPLETE, DATA_FRAGM_ALLOWED, len, ble_name);
+	else
 #endif
+		bls_ll_setScanRspData((uint8_t *) ble_name, len);
+}
+
+void ble_scan_response_callback(uint8_t e, uint8_t *p, int n) {
+	(void) e; (void) p; (void) n;
+	if(cfg.scan_rsp)
+		ble_set_scan_rsp();
+}
 
 void ble_disconnect_callback(uint8_t e, uint8_t *p, int n) {
 	if(ble_connected & 0x80) // reset device on disconnect?
 		start_reboot();
-	else if (ble_connected & 0x10) // is in connected state?
+	else if (ble_connected & 0x30) // is in connectable mode or window?
 		ev_adv_timeout(0,0,0);
 
 	bls_pm_setManualLatency(0); // ?
 
 	ble_connected = 0;
+	phy_req_tick = 0;
+	transfer_stat.ops = 0;
+	ess_trg_init();
+	rf_set_power_level_index(tx_power_adv);
+	if(ota_is_working)
+		ota_resume_save();
 	ota_is_working = 0;
 	mi_key_stage = 0;
 	//lcd_flg.b.notify_on = 0;
@@ -104,9 +217,131 @@ void ble_disconnect_callback(uint8_t e, uint8_t *p, int n) {
 void ble_connect_callback(uint8_t e, uint8_t *p, int n) {
 	// bls_l2cap_setMinimalUpdateReqSendingTime_after_connCreate(1000);
 	ble_connected |= 1;
+#if USE_EXT_ADV
+	ext_adv_end_tick = 0;
+#endif
+	if(cfg.flg3.conn_phy)
+		phy_req_tick = clock_time() | 1;
+	memset(&transfer_stat, 0, sizeof(transfer_stat));
+	transfer_tick = clock_time();
+	memset(&pm_stat, 0, sizeof(pm_stat));
+	rf_set_power_level_index(ble_tx_power());
 	bls_l2cap_requestConnParamUpdate(my_periConnParameters.intervalMin, my_periConnParameters.intervalMax, my_periConnParameters.latency, my_periConnParameters.timeout);
 }
 
+/* Maximum notification size for the MTU negotiated in this connection
+ * (the stack keeps the effective MTU, ATT_MTU_SIZE until an exchange) */
+_attribute_ram_code_ uint16_t ble_tx_size(void) {
+	uint16_t mtu = blc_att_getEffectiveMtuSize(BLS_CONN_HANDLE);
+	if(mtu > ATT_MTU_MAX_SIZE)
+		mtu = ATT_MTU_MAX_SIZE;
+	else if(mtu < ATT_MTU_SIZE)
+		mtu = ATT_MTU_SIZE;
+	return mtu - 3;
+}
+
+/* Connection PHY request (cfg.flg3.conn_phy), sent a while after the connection
+ * so as not to overlap with the connection parameters update.
+ * The link layer stays on 1M if the central does not support the PHY. */
+void ble_phy_update(void) {
+	if(phy_req_tick && clock_time() - phy_req_tick > PHY_REQ_DELAY_us * CLOCK_16M_SYS_TIMER_CLK_1US) {
+		phy_req_tick = 0;
+		if(cfg.flg3.conn_phy == 1)
+			blc_ll_setPhy(BLS_CONN_HANDLE, PHY_TRX_PREFER, PHY_PREFER_2M, PHY_PREFER_2M, CODED_PHY_PREFER_NONE);
+		else
+			blc_ll_setPhy(BLS_CONN_HANDLE, PHY_TRX_PREFER, PHY_PREFER_CODED, PHY_PREFER_CODED,
+					(cfg.flg3.conn_phy == 2)? CODED_PHY_PREFER_S2 : CODED_PHY_PREFER_S8);
+	}
+}
+
+/* Time accounting of the transfer and low-power modes, called from main_loop()
+ * (much more often than the clock_time() wrap, 268 sec) */
+_attribute_ram_code_ void ble_transfer_poll(void) {
+	if(ble_connected & 1) {
+		uint32_t ms = (clock_time() - transfer_tick) / CLOCK_16M_SYS_TIMER_CLK_1MS;
+		if(ms) {
+			transfer_tick += ms * CLOCK_16M_SYS_TIMER_CLK_1MS;
+			if(transfer_stat.ops) {
+				transfer_stat.transfer_ms += ms;
+				transfer_cur_ms += ms;
+			} else
+				transfer_stat.lowpower_ms += ms;
+		}
+	}
+}
+
+/* Bulk transfer start: no slave latency and the shortest connection interval
+ * the central accepts from TRANSFER_INTERVAL_MIN..TRANSFER_INTERVAL_MAX */
+void ble_transfer_start(uint8_t op) {
+	if((ble_connected & 1) == 0)
+		return;
+	ble_transfer_poll();
+	if(transfer_stat.ops == 0) {
+		transfer_cur_ms = 0;
+		transfer_stat.count++;
+		bls_pm_setManualLatency(0);
+		bls_l2cap_requestConnParamUpdate(TRANSFER_INTERVAL_MIN, TRANSFER_INTERVAL_MAX, 0, my_periConnParameters.timeout);
+	}
+	transfer_stat.ops |= op;
+}
+
+/* Bulk transfer end: after the last one, return to the low-power connection
+ * parameters and notify the transfer statistics */
+void ble_transfer_end(uint8_t op) {
+	if((transfer_stat.ops & op) == 0)
+		return;
+	ble_transfer_poll();
+	transfer_stat.ops &= ~op;
+	if(transfer_stat.ops == 0) {
+		transfer_stat.last_ms = transfer_cur_ms;
+		bls_pm_setManualLatency(cfg.connect_latency);
+		bls_l2cap_requestConnParamUpdate(my_periConnParameters.intervalMin, my_periConnParameters.intervalMax, my_periConnParameters.latency, my_periConnParameters.timeout);
+		if(RxTxValueInCCC[0] | RxTxValueInCCC[1])
+			ble_send_transfer();
+	}
+}
+
+/* Sleep time accounting of the connection (CMD_ID_PM_STAT): from the end of
+ * main_loop() or the suspend enter event to the wakeup from suspend or deep retention */
+_attribute_ram_code_ void pm_stat_sleep(void) {
+	pm_sleep_tick = clock_time() | 1;
+}
+
+_attribute_ram_code_ static uint32_t pm_time_add(uint32_t ms, uint16_t *pus, uint32_t ticks) {
+	uint32_t us = *pus + ticks / CLOCK_16M_SYS_TIMER_CLK_1US;
+	*pus = us % 1000;
+	return ms + us / 1000;
+}
+
+_attribute_ram_code_ void pm_stat_wakeup(int retention) {
+	if(pm_sleep_tick && (ble_connected & 1)) {
+		uint32_t ticks = clock_time() - pm_sleep_tick;
+		if(retention)
+			pm_stat.retention_ms = pm_time_add(pm_stat.retention_ms, &pm_retention_us, ticks);
+		else
+			pm_stat.suspend_ms = pm_time_add(pm_stat.suspend_ms, &pm_suspend_us, ticks);
+		pm_stat.wakeups++;
+	}
+	pm_sleep_tick = 0;
+}
+
+void ble_send_pm_stat(void) {
+	uint32_t sleep_ms = pm_stat.suspend_ms + pm_stat.retention_ms;
+	ble_transfer_poll();
+	pm_stat.conn_ms = transfer_stat.transfer_ms + transfer_stat.lowpower_ms;
+	pm_stat.awake_ms = (pm_stat.conn_ms > sleep_ms)? pm_stat.conn_ms - sleep_ms : 0;
+	send_buf[0] = CMD_ID_PM_STAT;
+	memcpy(&send_buf[1], &pm_stat, sizeof(pm_stat));
+	bls_att_pushNotifyData(RxTx_CMD_OUT_DP_H, send_buf, sizeof(pm_stat) + 1);
+}
+
+void ble_send_transfer(void) {
+	transfer_stat.interval = bls_ll_getConnectionInterval();
+	send_buf[0] = CMD_ID_TRANSFER;
+	memcpy(&send_buf[1], &transfer_stat, sizeof(transfer_stat));
+	bls_att_pushNotifyData(RxTx_CMD_OUT_DP_H, send_buf, sizeof(transfer_stat) + 1);
+}
+
 int app_conn_param_update_response(u8 id, u16  result) {
 	if(result == CONN_PARAM_UPDATE_ACCEPT)
 		ble_connected |= 2;
@@ -116,41 +351,335 @@ int app_conn_param_update_response(u8 id, u16  result) {
 	return 0;
 }
 
+RAM ota_resume_t ota_resume;
+extern int ota_adr_index;
 extern u32 blt_ota_start_tick;
+
+static uint32_t ota_crc32(uint32_t crc, uint8_t *p, uint32_t len) {
+	int i;
+	while(len--) {
+		crc ^= *p++;
+		for(i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xEDB88320 & (-(crc & 1)));
+	}
+	return crc;
+}
+
+/* Link lost during the OTA: save the SDK OTA state and stop the SDK OTA
+ * (its timeout would end the OTA with an error and reboot) */
+void ota_resume_save(void) {
+	if(ota_resume.index && ota_stat.state == 1) {
+		memcpy(&ota_resume.ota, &blcOta, sizeof(ota_resume.ota));
+		ota_resume.adr_index = ota_adr_index;
+		ota_resume.state = OTA_RESUME_SAVED;
+		blcOta.ota_start_flag = 0;
+		blt_ota_start_tick = 0;
+	} else
+		ota_resume.state = OTA_RESUME_NONE;
+}
+
+/* CMD_ID_OTA_RESUME: start the verification of the data written before the link loss.
+ * Returns 0 if there is nothing to resume. */
+int ota_resume_check(void) {
+	if(ota_resume.state == OTA_RESUME_NONE || ota_is_working)
+		return 0;
+	ota_resume.state = OTA_RESUME_CHECK;
+	ota_resume.chk = 0;
+	ota_resume.crc_chk = 0xffffffff;
+	return 1;
+}
+
+/* Verification of the data written, 1 KB per call from main_loop().
+ * Returns 1 while pending. */
+int ota_resume_step(void) {
+	uint8_t buf[256];
+	uint32_t i, n;
+	for(i = 0; i < 4 && ota_resume.chk < ota_resume.index; i++) {
+		n = ota_resume.index - ota_resume.chk;
+		if(n > sizeof(buf) / 16)
+			n = sizeof(buf) / 16;
+		flash_read_page(ota_program_offset + (ota_resume.chk << 4), n << 4, buf);
+		ota_resume.crc_chk = ota_crc32(ota_resume.crc_chk, buf, n << 4);
+		ota_resume.chk += n;
+	}
+	if(ota_resume.chk < ota_resume.index)
+		return 1;
+	if(ota_resume.crc_chk == ota_resume.crc)
+		ota_resume.state = OTA_RESUME_READY;
+	else
+		ota_resume.state = OTA_RESUME_NONE;
+	return 0;
+}
+
+static void ota_stat_update(void) {
+	ota_stat.time_ms = (clock_time() - ota_start_tick) / CLOCK_16M_SYS_TIMER_CLK_1MS;
+	if(ota_stat.time_ms)
+		ota_stat.speed = ota_stat.bytes * 1000 / ota_stat.time_ms;
+}
+
+static void ota_result(int result) {
+	ota_stat.state = 2;
+	ota_stat.result = result;
+	ota_resume.state = OTA_RESUME_NONE;
+	ota_stat_update();
+	if(otaStatCCC[0] | otaStatCCC[1])
+		bls_att_pushNotifyData(OTA_STAT_DP_H, (u8 *) &ota_stat, sizeof(ota_stat));
+}
+
+/* The OTA start and result callbacks, in init_ble() and again after
+ * the deep retention (the SDK does not keep them) */
+void ota_callbacks_init(void) {
+	bls_ota_registerStartCmdCb(app_enter_ota_mode);
+	bls_ota_registerResultIndicateCb(ota_result);
+}
+
+// OTA progress notification, called from main_loop() while the OTA is working
+void ota_stat_poll(void) {
+	if((otaStatCCC[0] | otaStatCCC[1])
+		&& clock_time() - ota_notify_tick > OTA_STAT_NOTIFY_us * CLOCK_16M_SYS_TIMER_CLK_1US
+		&& blc_ll_getTxFifoNumber() < 9) {
+		ota_notify_tick = clock_time();
+		ota_stat_update();
+		bls_att_pushNotifyData(OTA_STAT_DP_H, (u8 *) &ota_stat, sizeof(ota_stat));
+	}
+}
+
+/* A write with the larger MTU can carry several OTA PDUs (a multiple of
+ * OTA_PDU_SIZE bytes), they are passed to otaWrite() one by one in place */
 int otaWritePre(void * p) {
+	rf_packet_att_write_t *req = (rf_packet_att_write_t*)p;
+	uint32_t len = req->l2capLen - 3;
+	uint8_t *pd = &req->value;
+	uint32_t i;
+	int ret = 0;
 	blt_ota_start_tick = clock_time() | 1;
-	return otaWrite(p);
+	if(len < OTA_PDU_SIZE || len % OTA_PDU_SIZE) { // OTA commands
+		ret = otaWrite(p);
+		if(len >= 2 && pd[0] == U16_LO(CMD_OTA_START) && pd[1] == U16_HI(CMD_OTA_START)
+			&& ota_resume.state == OTA_RESUME_READY) {
+			// continue from ota_resume.index
+			memcpy(&blcOta, &ota_resume.ota, sizeof(blcOta));
+			ota_adr_index = ota_resume.adr_index;
+			ota_resume.state = OTA_RESUME_NONE;
+			ota_stat.bytes = ota_resume.index << 4;
+		}
+		return ret;
+	}
+	ota_stat.pdu_size = (len / OTA_PDU_SIZE) << 4;
+	req->l2capLen = OTA_PDU_SIZE + 3;
+	for(i = 0; i < len; i += OTA_PDU_SIZE) {
+		if(i)
+			memcpy(pd, pd + i, OTA_PDU_SIZE);
+		ret = otaWrite(p);
+		if(ret != OTA_SUCCESS || ota_stat.state == 2) // rejected (index or CRC error): the resume point stays
+			break;
+		ota_stat.bytes += OTA_PDU_SIZE - 4;
+		if((pd[0] | (pd[1] << 8)) == ota_resume.index) {
+			ota_resume.crc = ota_crc32(ota_resume.crc, pd + 2, OTA_PDU_SIZE - 4);
+			ota_resume.index++;
+		}
+	}
+	return ret;
 }
 
 _attribute_ram_code_
 int app_advertise_prepare_handler(rf_packet_adv_t * p)	{
 	adv_send_count++;
+	adv_stat.packets[adv_fmt]++;
 //	set_adv_data();
 	return 1;		// = 1 ready to send ADV packet, = 0 not send ADV
 }
 
 _attribute_ram_code_ int RxTxWrite(void * p) {
-	cmd_parser(p);
+	rf_packet_att_data_t *req = (rf_packet_att_data_t*) p;
+	cmd_queue_put(req->dat, req->l2cap - 3);
 	return 0;
 }
 
+/* TX power levels with the output power x0.5 dBm, ascending */
+static const uint8_t tx_pwr_tab[][2] = {
+	{ RF_POWER_N25p18dBm, (uint8_t)-50 }, { RF_POWER_N19p27dBm, (uint8_t)-39 },
+	{ RF_POWER_N15p88dBm, (uint8_t)-32 }, { RF_POWER_N13p29dBm, (uint8_t)-27 },
+	{ RF_POWER_N11p4dBm,  (uint8_t)-23 }, { RF_POWER_N9p89dBm,  (uint8_t)-20 },
+	{ RF_POWER_N8p65dBm,  (uint8_t)-17 }, { RF_POWER_N7p65dBm,  (uint8_t)-15 },
+	{ RF_POWER_N6p67dBm,  (uint8_t)-13 }, { RF_POWER_N5p81dBm,  (uint8_t)-12 },
+	{ RF_POWER_N5p03dBm,  (uint8_t)-10 }, { RF_POWER_N4p26dBm,  (uint8_t)-9 },
+	{ RF_POWER_N3p61dBm,  (uint8_t)-7 },  { RF_POWER_N3p03dBm,  (uint8_t)-6 },
+	{ RF_POWER_N2p48dBm,  (uint8_t)-5 },  { RF_POWER_N1p89dBm,  (uint8_t)-4 },
+	{ RF_POWER_N1p42dBm,  (uint8_t)-3 },  { RF_POWER_N0p97dBm,  (uint8_t)-2 },
+	{ RF_POWER_N0p14dBm,  0 },  { RF_POWER_P0p04dBm,  0 },
+	{ RF_POWER_P0p58dBm,  1 },  { RF_POWER_P0p90dBm,  2 },
+	{ RF_POWER_P1p17dBm,  2 },  { RF_POWER_P1p45dBm,  3 },
+	{ RF_POWER_P1p73dBm,  3 },  { RF_POWER_P1p99dBm,  4 },
+	{ RF_POWER_P2p39dBm,  5 },  { RF_POWER_P2p61dBm,  5 },
+	{ RF_POWER_P2p81dBm,  6 },  { RF_POWER_P3p01dBm,  6 },
+	{ RF_POWER_P3p23dBm,  6 },  { RF_POWER_P3p94dBm,  8 },
+	{ RF_POWER_P4p57dBm,  9 },  { RF_POWER_P5p13dBm,  10 },
+	{ RF_POWER_P5p65dBm,  11 }, { RF_POWER_P6p14dBm,  12 },
+	{ RF_POWER_P6p60dBm,  13 }, { RF_POWER_P7p02dBm,  14 },
+	{ RF_POWER_P7p41dBm,  15 }, { RF_POWER_P7p79dBm,  16 },
+	{ RF_POWER_P8p13dBm,  16 }, { RF_POWER_P8p44dBm,  17 },
+	{ RF_POWER_P8p73dBm,  17 }, { RF_POWER_P8p97dBm,  18 },
+	{ RF_POWER_P9p24dBm,  18 }, { RF_POWER_P9p48dBm,  19 },
+	{ RF_POWER_P9p81dBm,  20 }, { RF_POWER_P10p01dBm, 20 },
+	{ RF_POWER_P10p29dBm, 21 }, { RF_POWER_P10p46dBm, 21 }
+};
+#define TX_PWR_TAB_CNT (sizeof(tx_pwr_tab) / sizeof(tx_pwr_tab[0]))
+
+RAM uint8_t tx_power_adv; // advertising TX power: cfg.rf_tx_power or the adaptive level
+static RAM uint16_t tx_adapt_cnt; // measurements left for the adaptive level
+
+// Output power of a level, x0.5 dBm (an unknown level counts as the maximum)
+static int8_t tx_power_dbm2(uint8_t level) {
+	uint8_t i;
+	for(i = 0; i < TX_PWR_TAB_CNT; i++)
+		if(tx_pwr_tab[i][0] == level)
+			return (int8_t)tx_pwr_tab[i][1];
+	return (int8_t)tx_pwr_tab[TX_PWR_TAB_CNT - 1][1];
+}
+
+// TX power level for the current state: connection or advertising
+_attribute_ram_code_ uint8_t ble_tx_power(void) {
+	if((ble_connected & 1) && cfg.rf_tx_power_conn)
+		return cfg.rf_tx_power_conn;
+	return tx_power_adv;
+}
+
+/* Adaptive TX power: the gateway reports the RSSI of the advertising it
+ * receives (sent with tx_power_adv) and its receiver floor. The level is set
+ * to the minimum that keeps cfg.flg3.tx_margin * 2 dB above the floor,
+ * but not above cfg.rf_tx_power */
+void ble_tx_power_adapt(int8_t rssi, int8_t floor) {
+	uint8_t i, level = cfg.rf_tx_power;
+	int8_t max = tx_power_dbm2(cfg.rf_tx_power);
+	// path loss + floor + margin, x0.5 dBm
+	int16_t need = tx_power_dbm2(tx_power_adv) - rssi * 2 + floor * 2 + cfg.flg3.tx_margin * 4;
+	if(cfg.flg3.tx_margin == 0)
+		return;
+	for(i = 0; i < TX_PWR_TAB_CNT; i++) {
+		if((int8_t)tx_pwr_tab[i][1] > max)
+			break;
+		if((int8_t)tx_pwr_tab[i][1] >= need) {
+			level = tx_pwr_tab[i][0];
+			break;
+		}
+	}
+	tx_power_adv = level;
+	tx_adapt_cnt = TX_ADAPT_MEASURES;
+	rf_set_power_level_index(ble_tx_power());
+}
+
+// Called once per measurement: without RSSI reports the adaptive level expires
+_attribute_ram_code_ void tx_power_measure(void) {
+	if(tx_adapt_cnt && --tx_adapt_cnt == 0)
+		tx_power_adv = cfg.rf_tx_power;
+}
+
 _attribute_ram_code_ void user_set_rf_power(u8 e, u8 *p, int n) {
 	(void) e; (void) p; (void) n;
-	rf_set_power_level_index(cfg.rf_tx_power);
+	rf_set_power_level_index(ble_tx_power());
+	pm_stat_wakeup(0);
 }
 
-_attribute_ram_code_ void ev_adv_timeout(u8 e, u8 *p, int n)
-{
+_attribute_ram_code_ void ble_suspend_enter_callback(u8 e, u8 *p, int n) {
 	(void) e; (void) p; (void) n;
-	bls_ll_setAdvParam(adv_interval, adv_interval + 10,
-			ADV_TYPE_NONCONNECTABLE_UNDIRECTED, OWN_ADDRESS_PUBLIC, 0, NULL,
+	pm_stat_sleep();
+}
+
+#if USE_EXT_ADV
+/* Extended advertising set (cfg.flg3.adv_phy): the measurements go out as
+ * non-connectable extended advertising on 1M/2M or Coded PHY. The connectable
+ * mode uses legacy PDUs on 1M, so that any central can connect.
+ * Returns 0 if the link layer refused the set (legacy advertising is used then) */
+static int ext_adv_start(uint16_t intv_min, uint16_t intv_max, uint8_t adv_type) {
+	le_phy_type_t pri_phy = BLE_PHY_1M, sec_phy = BLE_PHY_1M;
+	adv_event_prop_t prop = ADV_EVT_PROP_LEGACY_CONNECTABLE_SCANNABLE_UNDIRECTED;
+	// tx_power_t covers 0..10 dBm only, the exact level is set after the setup
+	int8_t dbm = tx_power_dbm2(tx_power_adv) / 2;
+	if(dbm < TX_POWER_0dBm)
+		dbm = TX_POWER_0dBm;
+	else if(dbm > TX_POWER_10dBm)
+		dbm = TX_POWER_10dBm;
+	blc_ll_setExtAdvEnable_1(BLC_ADV_DISABLE, 1, ADV_HANDLE0, 0, 0);
+	if(adv_type != ADV_TYPE_CONNECTABLE_UNDIRECTED) {
+		prop = ADV_EVT_PROP_EXTENDED_NON_CONNECTABLE_NON_SCANNABLE_UNDIRECTED;
+		if(ext_adv_phy == 1)
+			sec_phy = BLE_PHY_2M;
+		else {
+			pri_phy = BLE_PHY_CODED;
+			sec_phy = BLE_PHY_CODED;
+			blc_ll_setDefaultExtAdvCodingIndication(ADV_HANDLE0,
+					(ext_adv_phy == 2)? CODED_PHY_PREFER_S2 : CODED_PHY_PREFER_S8);
+		}
+	}
+	if(blc_ll_setExtAdvParam(ADV_HANDLE0, prop, intv_min, intv_max,
+			BLT_ENABLE_ADV_ALL, OWN_ADDRESS_PUBLIC, BLE_ADDR_PUBLIC, NULL,
+			ADV_FP_NONE, (tx_power_t)dbm, pri_phy, 0, sec_phy, ADV_SID_0, 0) != BLE_SUCCESS)
+		return 0;
+	if(adv_buf.data[0])
+		blc_ll_setExtAdvData(ADV_HANDLE0, DATA_OPER_COMPLETE, DATA_FRAGM_ALLOWED,
+			(adv_buf.flag[0])? adv_buf.data[0] + 4 : adv_buf.data[0] + 1,
+			(adv_buf.flag[0])? (u8 *)&adv_buf : adv_buf.data);
+	if(prop == ADV_EVT_PROP_LEGACY_CONNECTABLE_SCANNABLE_UNDIRECTED)
+		blc_ll_setExtScanRspData(ADV_HANDLE0, DATA_OPER_COMPLETE, DATA_FRAGM_ALLOWED, scan_rsp_len, ble_name);
+	blc_ll_setExtAdvEnable_1(BLC_ADV_ENABLE, 1, ADV_HANDLE0, 0, 0);
+	rf_set_power_level_index(ble_tx_power()); // cfg.rf_tx_power or the adaptive level
+	return 1;
+}
+
+/* End of the timed extended advertising (the extended set does not
+ * raise BLT_EV_FLAG_ADV_DURATION_TIMEOUT), called from main_loop() */
+_attribute_ram_code_ void ext_adv_poll(void) {
+	if(ext_adv_end_tick && (ble_connected & 1) == 0
+		&& clock_time() - ext_adv_end_tick < BIT(31)) {
+		ext_adv_end_tick = 0;
+		ev_adv_timeout(0, 0, 0);
+	}
+}
+#endif
+
+/* Starts advertising with the interval in 0.625 ms units,
+ * duration_us = 0 - without limit, otherwise ev_adv_timeout() at the end */
+static void adv_start(uint16_t intv_min, uint16_t intv_max, uint8_t adv_type, uint32_t duration_us) {
+#if USE_EXT_ADV
+	if(ext_adv_phy) {
+		if(ext_adv_start(intv_min, intv_max, adv_type)) {
+			ext_adv_end_tick = (duration_us)? (clock_time() + duration_us * CLOCK_16M_SYS_TIMER_CLK_1US) | 1 : 0;
+			return;
+		}
+		ext_adv_phy = 0; // fallback to legacy advertising
+	}
+#endif
+	bls_ll_setAdvParam(intv_min, intv_max,
+			adv_type, OWN_ADDRESS_PUBLIC, 0, NULL,
 			BLT_ENABLE_ADV_ALL, ADV_FP_NONE);
 	bls_ll_setAdvEnable(1);
-	bls_ll_setAdvDuration(0, 0);
-	ble_connected &= ~0x10;
+	if(duration_us) {
+		bls_ll_setAdvDuration(duration_us, 1); // duration enable
+		bls_app_registerEventCallback(BLT_EV_FLAG_ADV_DURATION_TIMEOUT, &ev_adv_timeout);
+	} else
+		bls_ll_setAdvDuration(0, 0);
+}
+
+_attribute_ram_code_ void ev_adv_timeout(u8 e, u8 *p, int n)
+{
+	(void) e; (void) p; (void) n;
+	adv_start(adv_interval, adv_interval + 10, ADV_TYPE_NONCONNECTABLE_UNDIRECTED, 0);
+	ble_connected &= ~0x30;
+	ble_set_scan_rsp();
 	display_update();
 }
 
+/* Advertising burst after an event (trigger flip, sharp temperature change):
+ * cfg.event_adv_cnt packets at a short interval, then ev_adv_timeout()
+ * restores the normal advertising */
+void ble_event_adv(void) {
+	if (cfg.event_adv_cnt && (ble_connected & 0x31) == 0) { // not connected and not in connectable mode
+		adv_start(EVENT_ADV_INTERVAL, EVENT_ADV_INTERVAL + 8, // 50 ms - 55 ms
+				ADV_TYPE_NONCONNECTABLE_UNDIRECTED, cfg.event_adv_cnt * EVENT_ADV_PERIOD_us);
+	}
+}
+
 #if BLE_SECURITY_ENABLE
 int app_host_event_callback(u32 h, u8 *para, int n) {
 	(void) para; (void) n;
@@ -229,9 +758,49 @@ void ble_get_name(void) {
 		ble_name[0] = (uint8_t)(len + 1);
 	}
 	ble_name[1] = 0x09;
-#if BLE_ADV_TIME
-	add_resp_time();
+}
+
+// Prebuilt plain advertising templates, only the value fields are patched
+static RAM adv_atc1441_t adv_atc_tpl;
+static RAM adv_custom_t adv_cust_tpl;
+static RAM adv_custom_hist_t adv_hist_tpl;
+static RAM adv_mi_t adv_mi_tpl;
+
+// Builds the constant fields of the plain advertising templates
+__attribute__((optimize("-Os")))
+static void adv_tpl_init(void) {
+	adv_atc_tpl.size = sizeof(adv_atc1441_t) - 1;
+	adv_atc_tpl.uid = GAP_ADTYPE_SERVICE_DATA_UUID_16BIT; // 16-bit UUID
+	adv_atc_tpl.UUID = ADV_CUSTOM_UUID16; // GATT Service 0x181A Environmental Sensing (little-endian)
+	SwapMacAddress(adv_atc_tpl.MAC, mac_public);
+
+#if USE_TRIGGER_OUT
+	adv_cust_tpl.size = sizeof(adv_custom_t) - 1;
+#else
+	adv_cust_tpl.size = sizeof(adv_custom_t) - 2;
+#endif
+	adv_cust_tpl.uid = GAP_ADTYPE_SERVICE_DATA_UUID_16BIT; // 16-bit UUID
+	adv_cust_tpl.UUID = ADV_CUSTOM_UUID16; // GATT Service 0x181A Environmental Sensing (little-endian)
+	memcpy(adv_cust_tpl.MAC, mac_public, 6);
+
+	adv_hist_tpl.size = sizeof(adv_custom_hist_t) - 1;
+	adv_hist_tpl.uid = GAP_ADTYPE_SERVICE_DATA_UUID_16BIT; // 16-bit UUID
+	adv_hist_tpl.UUID = ADV_CUSTOM_UUID16; // GATT Service 0x181A Environmental Sensing (little-endian)
+
+	adv_mi_tpl.size = sizeof(adv_mi_t) - 1;
+	adv_mi_tpl.uid = GAP_ADTYPE_SERVICE_DATA_UUID_16BIT; // 16-bit UUID
+	adv_mi_tpl.UUID = ADV_XIAOMI_UUID16; // 16-bit UUID for Members 0xFE95 Xiaomi Inc.
+#if 0
+	adv_mi_tpl.ctrl.word = 0;
+	adv_mi_tpl.ctrl.bit.version = 3; // XIAOMI_DEV_VERSION
+	adv_mi_tpl.ctrl.bit.MACInclude = 1;
+	adv_mi_tpl.ctrl.bit.ObjectInclude = 1;
+#else
+	adv_mi_tpl.ctrl.word = 0x3050; // 0x3050 version = 3, MACInclude, ObjectInclude
 #endif
+	adv_mi_tpl.dev_id = DEVICE_TYPE;
+	adv_mi_tpl.nx10 = (XIAOMI_DATA_ID_TempAndHumidity >> 8) & 0xff; // (hi byte XIAOMI_DATA_ID)
+	memcpy(adv_mi_tpl.MAC, mac_public, 6);
 }
 
 __attribute__((optimize("-Os"))) void init_ble(void) {
@@ -243,6 +812,16 @@ __attribute__((optimize("-Os"))) void init_ble(void) {
 	blc_ll_initBasicMCU(); //must
 	blc_ll_initStandby_module(mac_public); //must
 	blc_ll_initAdvertising_module(mac_public); // adv module: 		 must for BLE slave,
+#if USE_EXT_ADV
+	ext_adv_phy = cfg.flg3.adv_phy;
+	if(ext_adv_phy) { // extended advertising: 2M / Coded PHY
+		blc_ll_initExtendedAdvertising_module(ext_adv_set_param, ext_adv_pri_pkt, 1);
+		blc_ll_initExtSecondaryAdvPacketBuffer(ext_adv_sec_pkt, sizeof(ext_adv_sec_pkt));
+		blc_ll_initExtAdvDataBuffer(ext_adv_data, sizeof(ext_adv_data));
+		blc_ll_initExtScanRspDataBuffer(ext_scan_rsp_data, sizeof(ext_scan_rsp_data));
+	}
+#endif
+	blc_ll_init2MPhyCodedPhy_feature(); // 2M / Coded PHY for the connection (cfg.flg3.conn_phy)
 	blc_ll_initConnection_module(); // connection module  must for BLE slave/master
 	blc_ll_initSlaveRole_module(); // slave module: 	 must for BLE slave,
 	blc_ll_initPowerManagement_module(); //pm module:      	 optional
@@ -250,6 +829,8 @@ __attribute__((optimize("-Os"))) void init_ble(void) {
 	////// Host Initialization  //////////
 	blc_gap_peripheral_init();
 	my_att_init(); //gatt initialization
+	ess_trg_init();
+	blc_att_setRxMtuSize(ATT_MTU_MAX_SIZE); // MTU exchange up to ATT_MTU_MAX_SIZE, see ble_tx_size()
 	blc_l2cap_register_handler(blc_l2cap_packet_receive);
 
 	//Smp Initialization may involve flash write/erase(when one sector stores too much information,
@@ -307,19 +888,14 @@ __attribute__((optimize("-Os"))) void init_ble(void) {
 	blc_smp_setSecurityLevel(No_Security);
 
 	///////////////////// USER application initialization ///////////////////
-#if BLE_ADV_TIME
-	bls_ll_setScanRspData((uint8_t *) ble_name, ble_name[0] + 1 + ble_name[ble_name[0]+1] + 1);
-#else
-	bls_ll_setScanRspData((uint8_t *) ble_name, ble_name[0]+1);
-#endif
-	rf_set_power_level_index(cfg.rf_tx_power);
+	ble_set_scan_rsp();
+	rf_set_power_level_index(ble_tx_power());
+	bls_app_registerEventCallback(BLT_EV_FLAG_SUSPEND_ENTER, &ble_suspend_enter_callback);
 	bls_app_registerEventCallback(BLT_EV_FLAG_SUSPEND_EXIT, &user_set_rf_power);
 	bls_app_registerEventCallback(BLT_EV_FLAG_CONNECT, &ble_connect_callback);
 	bls_app_registerEventCallback(BLT_EV_FLAG_TERMINATE,
 			&ble_disconnect_callback);
-#if BLE_ADV_TIME
 	bls_app_registerEventCallback(BLT_EV_FLAG_SCAN_RSP,	&ble_scan_response_callback);
-#endif
 
 	///////////////////// Power Management initialization///////////////////
 	blc_ll_initPowerManagement_module();
@@ -330,7 +906,7 @@ __attribute__((optimize("-Os"))) void init_ble(void) {
 #if USE_NEW_OTA == 0
 	bls_ota_clearNewFwDataArea();
 #endif
-	bls_ota_registerStartCmdCb(app_enter_ota_mode);
+	ota_callbacks_init();
 	blc_l2cap_registerConnUpdateRspCb(app_conn_param_update_response);
 	bls_set_advertise_prepare(app_advertise_prepare_handler);
 #if USE_MIHOME_BEACON
@@ -357,30 +933,164 @@ __attribute__((optimize("-Os"))) void init_ble(void) {
 		}
 	} else
 #endif
+	adv_tpl_init();
 	ev_adv_timeout(0,0,0);
 }
 
+/* Pushes the advertising data to the link layer only if it differs
+ * from the data set last time (adv_buf holds the current payload) */
+_attribute_ram_code_
+static void adv_update(uint8_t * pdata) {
+	uint8_t len = pdata[0] + 1;
+	uint8_t flg = (cfg.flg2.adv_flags)? 0x02 : 0;
+	if(len > ADV_BUFFER_SIZE)
+		len = ADV_BUFFER_SIZE;
+	if(adv_buf.flag[0] == flg
+		&& adv_buf.data[0] == pdata[0]
+		&& memcmp(adv_buf.data, pdata, len) == 0) {
+		adv_stat.skipped++;
+		return;
+	}
+	adv_stat.updates++;
+	memcpy(adv_buf.data, pdata, len);
+	adv_buf.flag[0] = flg;
+	if(flg) {
+		adv_buf.flag[1] = GAP_ADTYPE_FLAGS; // type
+		/*	Flags:
+		 	bit0: LE Limited Discoverable Mode
+			bit1: LE General Discoverable Mode
+			bit2: BR/EDR Not Supported
+			bit3: Simultaneous LE and BR/EDR to Same Device Capable (Controller)
+			bit4: Simultaneous LE and BR/EDR to Same Device Capable (Host)
+			bit5..7: Reserved
+		 */
+		adv_buf.flag[2] = 0x06; // Flags
+	}
+#if USE_EXT_ADV
+	if(ext_adv_phy) {
+		if(flg)
+			blc_ll_setExtAdvData(ADV_HANDLE0, DATA_OPER_COMPLETE, DATA_FRAGM_ALLOWED, len + 3, (u8 *)&adv_buf);
+		else
+			blc_ll_setExtAdvData(ADV_HANDLE0, DATA_OPER_COMPLETE, DATA_FRAGM_ALLOWED, len, adv_buf.data);
+	} else
+#endif
+	if(flg)
+		bls_ll_setAdvData((u8 *)&adv_buf, len + 3);
+	else
+		bls_ll_setAdvData((u8 *)&adv_buf.data, len);
+}
+
+// History of the previous readings for the custom advertising
+typedef struct _hist_rd_t {
+	int16_t temp; // x 0.01 C
+	uint16_t humi; // x 0.01 %
+} hist_rd_t;
+static RAM hist_rd_t hist_rd[ADV_HIST_CNT];
+static RAM uint8_t hist_idx; // next hist_rd[] slot
+static RAM uint8_t hist_cnt; // readings in hist_rd[]
+static RAM uint32_t hist_count; // measured_data.count of the newest reading in hist_rd[]
+
+// Stores the current reading, called once per new measurement after set_adv_data()
+_attribute_ram_code_ void adv_history_add(void) {
+	hist_count = measured_data.count;
+	hist_rd[hist_idx].temp = measured_data.temp;
+	hist_rd[hist_idx].humi = measured_data.humi;
+	if(++hist_idx >= ADV_HIST_CNT)
+		hist_idx = 0;
+	if(hist_cnt < ADV_HIST_CNT)
+		hist_cnt++;
+}
+
+static int8_t hist_delta(int32_t delta, int32_t step) {
+	delta = (delta >= 0)? (delta + (step >> 1)) / step : (delta - (step >> 1)) / step;
+	if(delta > 127)
+		delta = 127;
+	else if(delta < -127)
+		delta = -127;
+	return (int8_t)delta;
+}
+
+// Current values and the previous readings as differences from them, newest first
+_attribute_ram_code_ void adv_history_data(padv_hist_data_t p) {
+	uint8_t i, idx = hist_idx, cnt = hist_cnt;
+	// set_adv_data() again for the same measurement: the newest slot is the current reading
+	if(cnt && hist_count == measured_data.count) {
+		idx = (idx)? idx - 1 : ADV_HIST_CNT - 1;
+		cnt--;
+	}
+	p->temperature = measured_data.temp; // x0.01 C
+	p->humidity = measured_data.humi; // x0.01 %
+	p->battery_level = battery_level; // x1 %
+#if USE_TRIGGER_OUT
+	p->flags = trg.flg_byte;
+#else
+	p->flags = 0;
+#endif
+	for(i = 0; i < ADV_HIST_CNT; i++) {
+		if(i < cnt) {
+			idx = (idx)? idx - 1 : ADV_HIST_CNT - 1;
+			p->hist[i].temp = hist_delta(hist_rd[idx].temp - measured_data.temp, 10); // x0.1 C
+			p->hist[i].humi = hist_delta(hist_rd[idx].humi - measured_data.humi, 50); // x0.5 %
+		} else {
+			p->hist[i].temp = ADV_HIST_NONE;
+			p->hist[i].humi = ADV_HIST_NONE;
+		}
+	}
+}
+
+/* ADV_TYPE_ALL slot scheduler: smooth weighted round-robin over
+ * the formats weighted in cfg.adv_weights (2 bits per format, 0 - skip).
+ * Returns the format index: 0 - atc1441, 1 - pvvx, 2 - Mi, 3 - BTHome */
+_attribute_ram_code_
+static uint8_t adv_next_format(void) {
+	uint8_t weights = cfg.adv_weights;
+	uint8_t i, sel = 0;
+	int8_t w, total = 0, max = -128;
+	for(i = 0; i < ADV_FMT_NUM; i++) {
+		w = weights & 3;
+		weights >>= 2;
+		if(w) {
+			total += w;
+			adv_wrr[i] += w;
+			if(adv_wrr[i] > max) {
+				max = adv_wrr[i];
+				sel = i;
+			}
+		}
+	}
+	adv_wrr[sel] -= total;
+	return sel;
+}
+
 _attribute_ram_code_
 __attribute__((optimize("-Os")))
 void set_adv_data() {
-	uint8_t adv_type = cfg.flg.advertising_type; // 0 - atc1441, 1 - pvvx, 2 - Mi, 3 - all
+	uint8_t * pdata;
+	uint8_t adv_type = cfg.flg.advertising_type; // 0 - atc1441, 1 - pvvx, 2 - Mi, 3 - all, 4 - BTHome
 	adv_old_count = adv_send_count;
-	if(adv_type == ADV_TYPE_ALL)
-		adv_type = adv_old_count & 3;
-	/* adv_type: 0 - atc1441, 1 - Custom,  2,3 - Mi  */
-	if(adv_type == ADV_TYPE_PVVX) {
+	if(adv_type == ADV_TYPE_ALL) {
+		adv_fmt = adv_next_format();
+		adv_type = (adv_fmt == 3)? ADV_TYPE_BTHOME : adv_fmt;
+	} else
+		adv_fmt = (adv_type == ADV_TYPE_BTHOME)? 3 : adv_type;
+	/* adv_type: 0 - atc1441, 1 - Custom,  2 - Mi, 4 - BTHome  */
+	if(adv_type == ADV_TYPE_BTHOME) {
+#if USE_MIHOME_BEACON
 		if(cfg.flg2.mi_beacon)
-			pvvx_encrypt_beacon(measured_data.count);
-		else {
-			padv_custom_t p = (padv_custom_t)&adv_buf.data;
-			memcpy(p->MAC, mac_public, 6);
-#if USE_TRIGGER_OUT
-			p->size = sizeof(adv_custom_t) - 1;
-#else
-			p->size = sizeof(adv_custom_t) - 2;
+			pdata = bthome_encrypt_beacon(measured_data.count);
+		else
 #endif
-			p->uid = GAP_ADTYPE_SERVICE_DATA_UUID_16BIT; // 16-bit UUID
-			p->UUID = ADV_CUSTOM_UUID16; // GATT Service 0x181A Environmental Sensing (little-endian)
+			pdata = bthome_beacon();
+	} else if(adv_type == ADV_TYPE_PVVX) {
+		if(cfg.flg2.mi_beacon)
+			pdata = pvvx_encrypt_beacon(measured_data.count);
+		else if(cfg.flg2.adv_history) {
+			padv_custom_hist_t p = &adv_hist_tpl;
+			p->counter = (uint8_t)measured_data.count;
+			adv_history_data(&p->data);
+			pdata = (uint8_t *)p;
+		} else {
+			padv_custom_t p = &adv_cust_tpl;
 			p->temperature = measured_data.temp; // x0.01 C
 			p->humidity = measured_data.humi; // x0.01 %
 			p->battery_mv = measured_data.battery_mv; // x mV
@@ -389,33 +1099,20 @@ void set_adv_data() {
 #if USE_TRIGGER_OUT
 			p->flags = trg.flg_byte;
 #endif
+			pdata = (uint8_t *)p;
 		}
-	} else if(adv_type & ADV_TYPE_MASK_REF) { // adv_type == 2 or 3
+	} else if(adv_type == ADV_TYPE_MI) {
 #if USE_MIHOME_BEACON
 		if(cfg.flg2.mi_beacon) {
 			if(cfg.flg.advertising_type == ADV_TYPE_ALL)
-				mi_encrypt_beacon(measured_data.count);
+				pdata = mi_encrypt_beacon(measured_data.count);
 			else
-				mi_encrypt_beacon(measured_data.count >> 2);
+				pdata = mi_encrypt_beacon(measured_data.count >> 2);
 		}
 		else
 #endif
 		{
-			padv_mi_t p = (padv_mi_t)&adv_buf.data;
-			memcpy(p->MAC, mac_public, 6);
-			p->size = sizeof(adv_mi_t) - 1;
-			p->uid = GAP_ADTYPE_SERVICE_DATA_UUID_16BIT; // 16-bit UUID
-			p->UUID = ADV_XIAOMI_UUID16; // 16-bit UUID for Members 0xFE95 Xiaomi Inc.
-#if 0
-			p->ctrl.word = 0;
-			p->ctrl.bit.version = 3; // XIAOMI_DEV_VERSION
-			p->ctrl.bit.MACInclude = 1;
-			p->ctrl.bit.ObjectInclude = 1;
-#else
-			p->ctrl.word = 0x3050; // 0x3050 version = 3, MACInclude, ObjectInclude
-#endif
-			p->dev_id = DEVICE_TYPE;
-			p->nx10 = (XIAOMI_DATA_ID_TempAndHumidity >> 8) & 0xff; // (hi byte XIAOMI_DATA_ID)
+			padv_mi_t p = &adv_mi_tpl;
 			p->counter = (uint8_t)measured_data.count;
 			if (adv_old_count & 1) {
 				p->data_id = XIAOMI_DATA_ID_TempAndHumidity & 0xff; // (lo byte XIAOMI_DATA_ID)
@@ -427,27 +1124,13 @@ void set_adv_data() {
 				p->t0a.len1 = 1;
 				p->t0a.battery_level = battery_level; // Battery percentage, Range: 0-100
 			}
-#if USE_MIHOME_BEACON
+			pdata = (uint8_t *)p;
 		}
-#endif
 	} else { // adv_type == 0 == ADV_TYPE_ATC
 		if(cfg.flg2.mi_beacon)
-			atc_encrypt_beacon(measured_data.count);
+			pdata = atc_encrypt_beacon(measured_data.count);
 		else {
-			padv_atc1441_t p = (padv_atc1441_t)&adv_buf.data;
-			p->size = sizeof(adv_atc1441_t) - 1;
-			p->uid = GAP_ADTYPE_SERVICE_DATA_UUID_16BIT; // 16-bit UUID
-			p->UUID = ADV_CUSTOM_UUID16; // GATT Service 0x181A Environmental Sensing (little-endian)
-#if 1
-			SwapMacAddress(p->MAC, mac_public);
-#else
-			p->MAC[0] = mac_public[5];
-			p->MAC[1] = mac_public[4];
-			p->MAC[2] = mac_public[3];
-			p->MAC[3] = mac_public[2];
-			p->MAC[4] = mac_public[1];
-			p->MAC[5] = mac_public[0];
-#endif
+			padv_atc1441_t p = &adv_atc_tpl;
 			p->temperature[0] = (uint8_t)(last_temp >> 8);
 			p->temperature[1] = (uint8_t)last_temp; // x0.1 C
 			p->humidity = (uint8_t)last_humi; // x1 %
@@ -455,23 +1138,117 @@ void set_adv_data() {
 			p->battery_mv[0] = (uint8_t)(measured_data.battery_mv >> 8);
 			p->battery_mv[1] = (uint8_t)measured_data.battery_mv; // x1 mV
 			p->counter = (uint8_t)measured_data.count;
+			pdata = (uint8_t *)p;
 		}
 	}
-	if(cfg.flg2.adv_flags) {
-		adv_buf.flag[0] = 0x02; // size
-		adv_buf.flag[1] = GAP_ADTYPE_FLAGS; // type
-		/*	Flags:
-		 	bit0: LE Limited Discoverable Mode
-			bit1: LE General Discoverable Mode
-			bit2: BR/EDR Not Supported
-			bit3: Simultaneous LE and BR/EDR to Same Device Capable (Controller)
-			bit4: Simultaneous LE and BR/EDR to Same Device Capable (Host)
-			bit5..7: Reserved
-		 */
-		adv_buf.flag[2] = 0x06; // Flags
-		bls_ll_setAdvData((u8 *)&adv_buf, adv_buf.data[0] + 4);
-	} else
-		bls_ll_setAdvData((u8 *)&adv_buf.data, adv_buf.data[0] + 1);
+	adv_update(pdata);
+}
+
+RAM all_values_t all_values;
+
+// Fills the "all values" characteristic, once per measurement
+_attribute_ram_code_ void all_values_update(void) {
+	all_values.temp = measured_data.temp;
+	all_values.humi = measured_data.humi;
+	all_values.battery_mv = measured_data.battery_mv;
+	all_values.battery_level = battery_level;
+	all_values.count = measured_data.count;
+#if	USE_TRIGGER_OUT
+	all_values.flags = trg.flg_byte;
+#else
+	all_values.flags = 0;
+#endif
+}
+
+RAM ess_trg_t ess_trg[ESS_TRG_NUM];
+
+/* Notification triggers: by default, notify only if the value has changed.
+ * Called on start and on disconnect, the settings are not kept between connections. */
+void ess_trg_init(void) {
+	int i;
+	memset(ess_trg, 0, sizeof(ess_trg));
+	for(i = 0; i < ESS_TRG_NUM; i++)
+		ess_trg[i].condition = ESS_TRG_CHANGED;
+}
+
+/* Set a notification trigger (CMD_ID_NOTIFY_TRG): condition [operand].
+ * Returns -1 for an invalid setting, which is not applied. */
+int ess_trg_set(uint8_t idx, uint8_t * pd, uint32_t len) {
+	uint32_t olen;
+	if(idx >= ESS_TRG_NUM || len == 0 || pd[0] >= ESS_TRG_MAX)
+		return -1;
+	if(pd[0] == ESS_TRG_INACTIVE)
+		olen = 1;
+	else if(pd[0] == ESS_TRG_INTERVAL || pd[0] == ESS_TRG_MIN_TIME)
+		olen = 4; // uint24
+	else if(pd[0] == ESS_TRG_CHANGED && len == 1)
+		olen = 1; // any change
+	else
+		olen = 3; // int16
+	if(len != olen)
+		return -1;
+	memset(&ess_trg[idx], 0, sizeof(ess_trg[0])); // and reset the state
+	memcpy(&ess_trg[idx], pd, len);
+	return 0;
+}
+
+/* Called on each new measurement while the characteristic notification is enabled.
+ * Returns true if the value is to be notified. */
+_attribute_ram_code_ bool ess_trg_test(int idx, int16_t value) {
+	ess_trg_t *p = &ess_trg[idx];
+	int16_t operand = p->operand[0] | (p->operand[1] << 8);
+	uint32_t sec = p->operand[0] | (p->operand[1] << 8) | (p->operand[2] << 16);
+	int32_t delta;
+	bool met, ret = false;
+	switch(p->condition) {
+	case ESS_TRG_INTERVAL:
+		ret = (p->flg & 1) == 0 || utc_time_sec - p->time >= sec;
+		break;
+	case ESS_TRG_MIN_TIME:
+		ret = (p->flg & 1) == 0 || (value != p->value && utc_time_sec - p->time >= sec);
+		break;
+	case ESS_TRG_CHANGED:
+		delta = value - p->value;
+		if(delta < 0)
+			delta = -delta;
+		if(operand < 1)
+			operand = 1;
+		ret = (p->flg & 1) == 0 || delta >= operand;
+		break;
+	case ESS_TRG_LESS:
+	case ESS_TRG_LESS_EQU:
+	case ESS_TRG_GREATER:
+	case ESS_TRG_GREATER_EQU:
+	case ESS_TRG_EQU:
+	case ESS_TRG_NOT_EQU:
+		if(p->condition == ESS_TRG_LESS)
+			met = value < operand;
+		else if(p->condition == ESS_TRG_LESS_EQU)
+			met = value <= operand;
+		else if(p->condition == ESS_TRG_GREATER)
+			met = value > operand;
+		else if(p->condition == ESS_TRG_GREATER_EQU)
+			met = value >= operand;
+		else if(p->condition == ESS_TRG_EQU)
+			met = value == operand;
+		else
+			met = value != operand;
+		// notify at the crossing of the bound, in both directions
+		ret = met != ((p->flg >> 1) & 1);
+		if(met)
+			p->flg |= 2;
+		else
+			p->flg &= ~2;
+		break;
+	default: // ESS_TRG_INACTIVE
+		break;
+	}
+	if(ret) {
+		p->flg |= 1;
+		p->value = value;
+		p->time = utc_time_sec;
+	}
+	return ret;
 }
 
 _attribute_ram_code_ void ble_send_measures(void) {
@@ -506,12 +1283,8 @@ void ble_send_cmf(void) {
 void ble_conn_toggle(void)
 {
 	if ((ble_connected & 0x10) == 0) {
-		bls_ll_setAdvParam(96, 104, // 60ms - 65ms
-				ADV_TYPE_CONNECTABLE_UNDIRECTED, OWN_ADDRESS_PUBLIC, 0, NULL,
-				BLT_ENABLE_ADV_ALL, ADV_FP_NONE);
-		bls_ll_setAdvEnable(1);
-		bls_ll_setAdvDuration(150000000, 1); // interval usec (150s), duration enable
-		bls_app_registerEventCallback(BLT_EV_FLAG_ADV_DURATION_TIMEOUT, &ev_adv_timeout);
+		adv_start(96, 104, // 60ms - 65ms
+				ADV_TYPE_CONNECTABLE_UNDIRECTED, 150000000); // 150 s
 		ble_connected |= 0x10;
 		display_update();
 	} else {
@@ -519,6 +1292,56 @@ void ble_conn_toggle(void)
 	}
 }
 
+/* Scheduled connectable window: every cfg.conn_window minutes (aligned to
+ * UTC time, so the gateway knows when) the device advertises connectable
+ * for CONN_WINDOW_TIME_us. With bonding, the advertising is directed to
+ * the last bonded peer. Called from main_loop() */
+RAM uint32_t conn_window_idx;
+void conn_window_poll(void) {
+	uint32_t period, idx, sec;
+	if (cfg.conn_window == 0 || (ble_connected & 0x20))
+		return;
+	period = cfg.conn_window * 60;
+	idx = utc_time_sec / period;
+	if (ble_connected & 0x11) { // connected or connectable, the window of this period is not needed
+		conn_window_idx = idx;
+		return;
+	}
+	if (idx == conn_window_idx) {
+		// wake up at the start of the next period (uclock timers are limited to 1 hour)
+		sec = period - utc_time_sec % period;
+		if (sec > 3600)
+			sec = 3600;
+		uclock_awake_after(sec * 1000000);
+		return;
+	}
+	conn_window_idx = idx; // a late wakeup opens the window anyway
+	ble_connected |= 0x20;
+#if BLE_SECURITY_ENABLE
+	if (pincode
+#if USE_EXT_ADV
+		&& ext_adv_phy == 0
+#endif
+		) {
+		smp_param_save_t bondInfo;
+		uint8_t bond_number = blc_smp_param_getCurrentBondingDeviceNumber();
+		if (bond_number) {
+			bls_smp_param_loadByIndex(bond_number - 1, &bondInfo); // the latest bonding device
+			bls_ll_setAdvParam(96, 104, // 60ms - 65ms
+					ADV_TYPE_CONNECTABLE_DIRECTED_LOW_DUTY, OWN_ADDRESS_PUBLIC,
+					bondInfo.peer_addr_type, bondInfo.peer_addr,
+					BLT_ENABLE_ADV_ALL, ADV_FP_NONE);
+			bls_ll_setAdvEnable(1);
+			bls_ll_setAdvDuration(CONN_WINDOW_TIME_us, 1); // duration enable
+			bls_app_registerEventCallback(BLT_EV_FLAG_ADV_DURATION_TIMEOUT, &ev_adv_timeout);
+			return;
+		}
+	}
+#endif
+	adv_start(96, 104, // 60ms - 65ms
+			ADV_TYPE_CONNECTABLE_UNDIRECTED, CONN_WINDOW_TIME_us);
+}
+
 #if USE_TRIGGER_OUT
 void ble_send_trg(void) {
 	send_buf[0] = CMD_ID_TRG;
@@ -539,8 +1362,8 @@ __attribute__((optimize("-Os"))) void send_memo_blk(void) {
 		send_buf[1] = 0;
 		send_buf[2] = 0;
 		bls_att_pushNotifyData(RxTx_CMD_OUT_DP_H, send_buf, 3);
-		bls_pm_setManualLatency(cfg.connect_latency);
 		rd_memo.cnt = 0;
+		ble_transfer_end(TRANSFER_LOG);
 	} else {
 		send_buf[1] = rd_memo.cur;
 		send_buf[2] = rd_memo.cur >> 8;
@@ -6,23 +6,41 @@
 #include "stack/ble/ble.h"
 
 extern uint8_t ota_is_working;
-extern uint8_t ble_connected; // bit 0 - connected, bit 1 - conn_param_update, bit 2 - paring success, bit 7 - reset device on disconnect
+extern uint8_t ble_connected; // bit 0 - connected, bit 1 - conn_param_update, bit 2 - paring success, bit 4 - connectable mode, bit 5 - connectable window, bit 7 - reset device on disconnect
 extern uint32_t adv_send_count;
 extern uint32_t adv_old_count;
 #define ADV_BUFFER_SIZE		28
+#define EVENT_ADV_INTERVAL	80 // x0.625 ms = 50 ms, advertising interval of an event burst
+#define EVENT_ADV_PERIOD_us	57500 // average period of a burst packet, in us (interval + random delay 0..10 ms)
+#define PHY_REQ_DELAY_us	2000000 // connection PHY request delay after the connection, in us
+#define TX_ADAPT_MEASURES	360 // measurements without a new RSSI report before the adaptive TX power returns to cfg.rf_tx_power
+#define TX_ADAPT_FLOOR		-90 // dBm, default receiver floor of the gateway for the adaptive TX power
+#define TRANSFER_INTERVAL_MIN	6 // x1.25 ms = 7.5 ms, connection interval requested for bulk transfers
+#define TRANSFER_INTERVAL_MAX	12 // x1.25 ms = 15 ms
+#define CONN_WINDOW_TIME_us	5000000 // duration of the scheduled connectable window (cfg.conn_window), in us
 typedef struct __attribute__((packed)) _adv_buf_t {
 	uint8_t flag[3];
 	uint8_t data[ADV_BUFFER_SIZE];
 }adv_buf_t;
 extern adv_buf_t adv_buf;
+#define ADV_FMT_NUM		4 // formats in the ADV_TYPE_ALL rotation: atc1441, pvvx, Mi, BTHome
+// Advertising data statistics (CMD_ID_ADV_STAT)
+typedef struct __attribute__((packed)) _adv_stat_t {
+	uint32_t	updates;	// advertising data pushed to the link layer
+	uint32_t	skipped;	// unchanged advertising data not pushed
+	uint16_t	packets[ADV_FMT_NUM]; // advertising packets sent per format (atc1441, pvvx, Mi, BTHome)
+} adv_stat_t;
+extern adv_stat_t adv_stat;
 //extern uint8_t adv_buffer[ADV_BUFFER_SIZE];
 extern bool show_temp_humi_Mi;
 extern u8 batteryValueInCCC[2];
 extern u8 tempValueInCCC[2];
 extern u8 temp2ValueInCCC[2];
 extern u8 humiValueInCCC[2];
+extern u8 allValueInCCC[2];
 extern u8 RxTxValueInCCC[2];
-#define SEND_BUFFER_SIZE	(ATT_MTU_SIZE-3) // = 20
+#define ATT_MTU_MAX_SIZE	128 // max. MTU (an MTU notification takes up to 6 of the 16 TX FIFO entries)
+#define SEND_BUFFER_SIZE	(ATT_MTU_MAX_SIZE-3) // = 125
 extern uint8_t send_buf[SEND_BUFFER_SIZE];
 extern uint8_t mac_public[6];
 extern uint8_t mac_random_static[6];
@@ -134,6 +152,32 @@ typedef struct __attribute__((packed)) _adv_custom_t {
 	uint8_t		flags; 
 } adv_custom_t, * padv_custom_t;
 
+// Custom format with the history of the previous readings (cfg.flg2.adv_history)
+#define ADV_HIST_CNT	6 // previous readings in the history advertising
+#define ADV_HIST_NONE	(-128) // no reading in the history slot
+typedef struct __attribute__((packed)) _adv_hist_t {
+	int8_t		temp;	// difference from the current temperature, x 0.1 degree
+	int8_t		humi;	// difference from the current humidity, x 0.5 %
+} adv_hist_t;
+
+typedef struct __attribute__((packed)) _adv_hist_data_t {
+	int16_t		temperature; // x 0.01 degree
+	uint16_t	humidity; // x 0.01 %
+	uint8_t		battery_level; // 0..100 %
+	uint8_t		flags;
+	adv_hist_t	hist[ADV_HIST_CNT]; // [0] - reading counter-1, [1] - counter-2, ...
+} adv_hist_data_t, * padv_hist_data_t;
+
+// GATT Service 0x181A Environmental Sensing
+// All data little-endian
+typedef struct __attribute__((packed)) _adv_custom_hist_t {
+	uint8_t		size;	// = 22
+	uint8_t		uid;	// = 0x16, 16-bit UUID
+	uint16_t	UUID;	// = 0x181A, GATT Service 0x181A Environmental Sensing
+	uint8_t		counter; // measurement count
+	adv_hist_data_t data;
+} adv_custom_hist_t, * padv_custom_hist_t;
+
 // GATT Service 0x181A Environmental Sensing
 // mixture of little-endian and big-endian!
 typedef struct __attribute__((packed)) _adv_atc1441_t {
@@ -257,6 +301,7 @@ typedef enum
 	HUMI_LEVEL_INPUT_DP_H,					//UUID: 2A6F 	VALUE: measured_data.humi
 	HUMI_LEVEL_INPUT_CCB_H,					//UUID: 2902, 	VALUE: humiValCCC
 
+
 	//// Telink OTA ////
 	/**********************************************************************************************/
 	OTA_PS_H, 								//UUID: 2800, 	VALUE: telink ota service uuid
@@ -270,6 +315,13 @@ typedef enum
 	RxTx_CMD_OUT_CD_H,						//UUID: 2803, 	VALUE:  			Prop: read | write_without_rsp
 	RxTx_CMD_OUT_DP_H,						//UUID: 1F1F,  VALUE: RxTxData
 	RxTx_CMD_OUT_DESC_H,					//UUID: 2902, 	VALUE: RxTxValueInCCC
+	// new characteristics are appended here, so that the older handles stay
+	ALL_VALUES_CD_H,						//UUID: 2803, 	VALUE:  			Prop: Read | Notify
+	ALL_VALUES_DP_H,						//UUID: 1F1A 	VALUE: all_values
+	ALL_VALUES_CCB_H,						//UUID: 2902, 	VALUE: allValCCC
+	OTA_STAT_CD_H,							//UUID: 2803, 	VALUE:  			Prop: Read | Notify
+	OTA_STAT_DP_H,							//UUID: 1F1B,	VALUE: ota_stat
+	OTA_STAT_CCB_H,							//UUID: 2902, 	VALUE: otaStatCCC
 
 #if USE_MIHOME_SERVICE
 	// Mi Service
@@ -322,12 +374,102 @@ typedef enum
 }ATT_HANDLE;
 
 void set_adv_data(void);
-
-extern u8 my_RxTx_Data[16];
+void ble_phy_update(void);
+uint16_t ble_tx_size(void);
+// Bulk transfers (transfer_stat.ops) running on the short connection interval
+enum {
+	TRANSFER_LOG	= 0x01, // measurement log read
+	TRANSFER_KEYS	= 0x02, // Mi keys dump
+	TRANSFER_OTA	= 0x04  // firmware update
+};
+// Bulk transfer statistics (CMD_ID_TRANSFER)
+typedef struct __attribute__((packed)) _transfer_stat_t {
+	uint8_t		ops;		// TRANSFER_* in progress
+	uint16_t	interval;	// current connection interval, x1.25 ms
+	uint16_t	count;		// transfers in this connection
+	uint32_t	last_ms;	// duration of the last transfer, ms
+	uint32_t	transfer_ms; // time in the transfer mode in this connection, ms
+	uint32_t	lowpower_ms; // time in the low-power mode in this connection, ms
+} transfer_stat_t;
+extern transfer_stat_t transfer_stat;
+void ble_transfer_start(uint8_t op);
+void ble_transfer_end(uint8_t op);
+void ble_transfer_poll(void);
+void ble_send_transfer(void);
+// Power management statistics of the connection (CMD_ID_PM_STAT)
+typedef struct __attribute__((packed)) _pm_stat_t {
+	uint32_t	conn_ms;	// connection time, ms
+	uint32_t	awake_ms;	// awake (CPU and radio active), ms
+	uint32_t	suspend_ms;	// in suspend, ms
+	uint32_t	retention_ms; // in deep retention, ms
+	uint16_t	wakeups;	// wakeups from suspend or deep retention
+} pm_stat_t;
+extern pm_stat_t pm_stat;
+void pm_stat_sleep(void);
+void pm_stat_wakeup(int retention);
+void ble_send_pm_stat(void);
+extern uint8_t tx_power_adv;
+uint8_t ble_tx_power(void);
+void ble_tx_power_adapt(int8_t rssi, int8_t floor);
+void tx_power_measure(void);
+#if USE_EXT_ADV
+extern uint8_t ext_adv_phy;
+void ext_adv_poll(void);
+#endif
+// Scan response items (cfg.scan_rsp), sent in this order in the service data 0x1F11 after the items byte
+enum {
+	SCAN_RSP_TIME	= 0x01, // uint32: UTC time, sec
+	SCAN_RSP_MINMAX	= 0x02, // int16, int16, uint16, uint16: temperature min, max x0.01 C, humidity min, max x0.01 % since the previous scan response
+	SCAN_RSP_BATT	= 0x04, // uint16: battery, mV
+	SCAN_RSP_VER	= 0x08, // uint8, uint8: firmware version (BCD), config checksum
+	SCAN_RSP_MEMO	= 0x10  // uint16: write position of the measurement log, records
+} SCAN_RSP_ITEMS;
+void ble_set_scan_rsp(void);
+void scan_rsp_measure(void);
+void adv_history_add(void);
+void adv_history_data(padv_hist_data_t p);
+
+extern u8 my_RxTx_Data[sizeof(cfg_t) + 3];
+
+// Notification trigger conditions of the temperature and humidity characteristics (CMD_ID_NOTIFY_TRG),
+// as in the ES Trigger Setting descriptor (0x290D)
+enum {
+	ESS_TRG_INACTIVE = 0,	// no notifications
+	ESS_TRG_INTERVAL,		// uint24: fixed time interval, sec
+	ESS_TRG_MIN_TIME,		// uint24: no less than the time between notifications, sec
+	ESS_TRG_CHANGED,		// value changed [int16: by at least, in the characteristic units]
+	ESS_TRG_LESS,			// int16: value crosses "less than"
+	ESS_TRG_LESS_EQU,		// int16: value crosses "less than or equal to"
+	ESS_TRG_GREATER,		// int16: value crosses "greater than"
+	ESS_TRG_GREATER_EQU,	// int16: value crosses "greater than or equal to"
+	ESS_TRG_EQU,			// int16: value crosses "equal to"
+	ESS_TRG_NOT_EQU,		// int16: value crosses "not equal to"
+	ESS_TRG_MAX
+} ESS_TRG_CONDITIONS;
+// Notification trigger setting and its state, per characteristic
+typedef struct __attribute__((packed)) _ess_trg_t {
+	uint8_t		condition;
+	uint8_t		operand[3];
+	// state
+	uint8_t		flg; // bit 0 - value notified, bit 1 - condition met
+	int16_t		value; // last notified value
+	uint32_t	time; // last notification time, utc_time_sec
+} ess_trg_t;
+enum {
+	ESS_TRG_TEMP = 0,	// 0x2A1F
+	ESS_TRG_TEMP2,		// 0x2A6E
+	ESS_TRG_HUMI,		// 0x2A6F
+	ESS_TRG_NUM
+};
+extern ess_trg_t ess_trg[ESS_TRG_NUM];
+void ess_trg_init(void);
+int ess_trg_set(uint8_t idx, uint8_t * pd, uint32_t len);
+bool ess_trg_test(int idx, int16_t value);
 
 void my_att_init();
 void init_ble();
 void ble_conn_toggle();
+void conn_window_poll(void);
 void ble_get_name(void);
 bool ble_get_connected();
 void ble_send_measures(void);
@@ -341,9 +483,45 @@ void ble_send_trg_flg(void);
 #if USE_FLASH_MEMO
 void send_memo_blk(void);
 #endif
+// OTA progress (characteristic 0x1F1B)
+#define OTA_PDU_SIZE		20 // Telink OTA PDU: index[2], data[16], crc[2]
+#define OTA_STAT_NOTIFY_us	1000000 // OTA progress notification period, in us
+typedef struct __attribute__((packed)) _ota_stat_t {
+	uint8_t		state;		// 0 - idle, 1 - working, 2 - end
+	uint8_t		result;		// OTA_SUCCESS, OTA_PACKET_LOSS, ...
+	uint16_t	pdu_size;	// OTA data bytes per write (multiple of 16)
+	uint32_t	bytes;		// firmware bytes received
+	uint32_t	time_ms;	// time since the OTA start, ms
+	uint32_t	speed;		// bytes/s
+} ota_stat_t;
+extern ota_stat_t ota_stat;
+extern u8 otaStatCCC[2];
+void ota_stat_poll(void);
+void ota_callbacks_init(void);
+// Resumable OTA: state saved on link loss, kept in the retention RAM
+enum {
+	OTA_RESUME_NONE = 0,
+	OTA_RESUME_SAVED,	// link lost during the OTA
+	OTA_RESUME_CHECK,	// verifying the data written (ota_resume_step())
+	OTA_RESUME_READY	// verified, the next OTA start continues from ota_resume.index
+};
+typedef struct _ota_resume_t {
+	uint8_t		state;		// OTA_RESUME_*
+	uint16_t	index;		// next OTA PDU index (= PDUs written)
+	uint16_t	chk;		// PDUs verified
+	uint32_t	crc;		// CRC32 of the firmware data written
+	uint32_t	crc_chk;	// CRC32 of the data verified
+	int			adr_index;	// SDK ota_adr_index
+	ota_service_t ota;		// SDK blcOta
+} ota_resume_t;
+extern ota_resume_t ota_resume;
+void ota_resume_save(void);
+int ota_resume_check(void);
+int ota_resume_step(void);
 int otaWritePre(void * p);
 int RxTxWrite(void * p);
 void ev_adv_timeout(u8 e, u8 *p, int n);
+void ble_event_adv(void);
 
 inline void ble_send_temp(void) {
 	bls_att_pushNotifyData(TEMP_LEVEL_INPUT_DP_H, (u8 *) &last_temp, 2);
@@ -357,6 +535,22 @@ inline void ble_send_humi(void) {
 	bls_att_pushNotifyData(HUMI_LEVEL_INPUT_DP_H, (u8 *) &measured_data.humi, 2);
 }
 
+// All measured values in one characteristic (one notification per measurement)
+typedef struct __attribute__((packed)) _all_values_t {
+	int16_t		temp; // x 0.01 C
+	uint16_t	humi; // x 0.01 %
+	uint16_t	battery_mv; // mV
+	uint8_t		battery_level; // 0..100 %
+	uint16_t	count; // measurement count
+	uint8_t		flags; // trg.flg_byte
+} all_values_t;
+extern all_values_t all_values;
+void all_values_update(void);
+
+inline void ble_send_all(void) {
+	bls_att_pushNotifyData(ALL_VALUES_DP_H, (u8 *) &all_values, sizeof(all_values));
+}
+
 inline void ble_send_battery(void) {
 	bls_att_pushNotifyData(BATT_LEVEL_INPUT_DP_H, (u8 *) &battery_level, 1);
 }
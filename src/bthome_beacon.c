@@ -0,0 +1,92 @@
+/*
+ * bthome_beacon.c
+ */
+#include <stdint.h>
+#include "tl_common.h"
+#include "app_config.h"
+#include "ble.h"
+#include "battery.h"
+#include "app.h"
+#if	USE_TRIGGER_OUT
+#include "trigger.h"
+#endif
+#if USE_MIHOME_BEACON
+#include "mi_beacon.h"
+#include "ccm.h"
+#endif
+#include "bthome_beacon.h"
+
+#if USE_MIHOME_BEACON
+/* BTHome encrypted nonce */
+typedef struct __attribute__((packed)) _bthome_beacon_nonce_t{
+    uint8_t  mac[6];	// big-endian MAC
+    uint16_t uuid16;	// = 0xFCD2
+    uint8_t  info;		// = BtHomeID_Info_Encrypt
+    uint32_t cnt32;
+} bthome_beacon_nonce_t;
+
+RAM uint32_t adv_bthome_cnt = 0xffffffff; // counter of measurement numbers from sensors
+RAM adv_bthome_enc_t adv_bthome_enc_buf;
+#endif
+RAM adv_bthome_t adv_bthome_buf;
+
+_attribute_ram_code_
+static void bthome_data(padv_bthome_data_t p) {
+	p->pid_id = BtHomeID_PacketId;
+	p->pid = (uint8_t)measured_data.count;
+	p->b_id = BtHomeID_battery;
+	p->battery_level = battery_level;
+	p->t_id = BtHomeID_temperature;
+	p->temperature = measured_data.temp; // x0.01 C
+	p->h_id = BtHomeID_humidity;
+	p->humidity = measured_data.humi; // x0.01 %
+	p->v_id = BtHomeID_voltage;
+	p->battery_mv = measured_data.battery_mv; // x mV
+#if USE_TRIGGER_OUT
+	p->s_id = BtHomeID_switch;
+	p->swtch = trg.flg.trg_output;
+#endif
+}
+
+/* Create BTHome v2 beacon packet (all values in one packet) */
+_attribute_ram_code_
+uint8_t * bthome_beacon(void) {
+	padv_bthome_t p = &adv_bthome_buf;
+	p->head.size = sizeof(adv_bthome_t) - 1;
+	p->head.uid = GAP_ADTYPE_SERVICE_DATA_UUID_16BIT; // 16-bit UUID
+	p->head.UUID = ADV_BTHOME_UUID16;
+	p->head.info = BtHomeID_Info;
+	bthome_data(&p->data);
+	return (uint8_t *)p;
+}
+
+#if USE_MIHOME_BEACON
+/* Create encrypted BTHome v2 beacon packet (AES-CCM, bindkey)
+ * https://bthome.io/encryption/ */
+__attribute__((optimize("-Os")))
+uint8_t * bthome_encrypt_beacon(uint32_t cnt) {
+	padv_bthome_enc_t p = &adv_bthome_enc_buf;
+	if(adv_bthome_cnt != cnt) { // measurement counter update?
+		adv_bthome_cnt = cnt; // new counter
+		bthome_beacon_nonce_t cbn;
+		adv_bthome_data_t data;
+		p->head.size = sizeof(adv_bthome_enc_t) - 1;
+		p->head.uid = GAP_ADTYPE_SERVICE_DATA_UUID_16BIT; // 16-bit UUID
+		p->head.UUID = ADV_BTHOME_UUID16;
+		p->head.info = BtHomeID_Info_Encrypt;
+		p->count = cnt;
+		bthome_data(&data);
+		SwapMacAddress(cbn.mac, mac_public);
+		cbn.uuid16 = ADV_BTHOME_UUID16;
+		cbn.info = BtHomeID_Info_Encrypt;
+		cbn.cnt32 = cnt;
+		aes_ccm_encrypt_and_tag((const unsigned char *)&bindkey,
+						   (uint8_t*)&cbn, sizeof(cbn),
+						   NULL, 0,
+						   (uint8_t *)&data, sizeof(data),
+						   (uint8_t *)&p->data,
+						   p->mic, 4);
+	}
+	return (uint8_t *)p;
+}
+#endif // USE_MIHOME_BEACON
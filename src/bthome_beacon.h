@@ -0,0 +1,68 @@
+/*
+ * bthome_beacon.h
+ */
+
+#ifndef BTHOME_BEACON_H_
+#define BTHOME_BEACON_H_
+
+#include <stdint.h>
+#include "app_config.h"
+
+// BTHome v2 https://bthome.io/format/
+#define ADV_BTHOME_UUID16	0xFCD2 // 16-bit UUID Service 0xFCD2 BTHome
+
+#define BtHomeID_Info			0x40 // Device info: bit0 - encrypted, bits5..7 - version 2
+#define BtHomeID_Info_Encrypt	0x41
+
+enum { // BTHome v2 object ids (must be sent in ascending order)
+	BtHomeID_PacketId		= 0x00, // uint8
+	BtHomeID_battery		= 0x01, // uint8, %
+	BtHomeID_temperature	= 0x02, // sint16, 0.01 °C
+	BtHomeID_humidity		= 0x03, // uint16, 0.01 %
+	BtHomeID_voltage		= 0x0C, // uint16, 0.001 V
+	BtHomeID_switch			= 0x10, // uint8, binary: 0 - off, 1 - on
+	BtHomeID_opening		= 0x11  // uint8, binary: 0 - closed, 1 - open
+} BtHomeIDs;
+
+typedef struct __attribute__((packed)) _adv_bthome_data_t {
+	uint8_t		pid_id;		// = BtHomeID_PacketId
+	uint8_t		pid;		// measurement count
+	uint8_t		b_id;		// = BtHomeID_battery
+	uint8_t		battery_level; // 0..100 %
+	uint8_t		t_id;		// = BtHomeID_temperature
+	int16_t		temperature; // x 0.01 degree
+	uint8_t		h_id;		// = BtHomeID_humidity
+	uint16_t	humidity;	// x 0.01 %
+	uint8_t		v_id;		// = BtHomeID_voltage
+	uint16_t	battery_mv;	// mV
+#if USE_TRIGGER_OUT
+	uint8_t		s_id;		// = BtHomeID_switch
+	uint8_t		swtch;		// GPIO_TRG pin output value
+#endif
+} adv_bthome_data_t, * padv_bthome_data_t;
+
+typedef struct __attribute__((packed)) _adv_bthome_head_t {
+	uint8_t		size;	// = 19 (plain), 27 (encrypted)
+	uint8_t		uid;	// = 0x16, 16-bit UUID
+	uint16_t	UUID;	// = 0xFCD2, BTHome
+	uint8_t		info;	// = BtHomeID_Info or BtHomeID_Info_Encrypt
+} adv_bthome_head_t, * padv_bthome_head_t;
+
+typedef struct __attribute__((packed)) _adv_bthome_t {
+	adv_bthome_head_t head;
+	adv_bthome_data_t data;
+} adv_bthome_t, * padv_bthome_t;
+
+typedef struct __attribute__((packed)) _adv_bthome_enc_t {
+	adv_bthome_head_t head;
+	adv_bthome_data_t data;	// encrypted
+	uint32_t	count;		// encryption counter
+	uint8_t		mic[4];
+} adv_bthome_enc_t, * padv_bthome_enc_t;
+
+uint8_t * bthome_beacon(void);
+#if USE_MIHOME_BEACON
+uint8_t * bthome_encrypt_beacon(uint32_t cnt);
+#endif
+
+#endif /* BTHOME_BEACON_H_ */
@@ -30,12 +30,113 @@
 //#include "ccm.h"
 #include <stdint.h>
 #include "tl_common.h"
+#include "drivers.h"
+#include "app_config.h"
 #if USE_MIHOME_BEACON
 #include "stack/ble/crypt/aes/aes_att.h"
 
 #define CCM_ENCRYPT 0
 #define CCM_DECRYPT 1
 
+/*
+ * Hardware AES-128 (TLSR825x AES engine).
+ * The byte order of the engine is checked once by aes_ccm_init()
+ * against the software tn_aes_128(); if the engine does not match,
+ * the software path is used. An engine that does not respond within
+ * AES_HW_TIMEOUT_US switches to the software path for good.
+ */
+#define AES_HW_OFF	0 // software tn_aes_128()
+#define AES_HW_LE	1 // hardware, bytes as is
+#define AES_HW_BE	2 // hardware, reversed byte order
+#define AES_HW_TIMEOUT_US	64 // limit of each wait for the engine, us (a block takes ~1 us)
+
+RAM uint8_t aes_hw_mode;		// AES_HW_xx, set by aes_ccm_init()
+static RAM uint8_t aes_use_hw;	// current mode for ccm_auth_crypt()
+static RAM uint8_t aes_key_src[16]; // the last key (as is)
+static RAM uint8_t aes_key_hw[16];	// the last key, in the engine byte order
+static RAM uint8_t aes_key_mode;	// aes_key_hw[] prepared for this mode
+
+/* Prepare the key (cached) and load it into the engine */
+_attribute_ram_code_
+static void aes_hw_set_key(const unsigned char *key) {
+	uint8_t i;
+	if (aes_key_mode != aes_use_hw || memcmp(aes_key_src, key, 16)) {
+		memcpy(aes_key_src, key, 16);
+		for (i = 0; i < 16; i++)
+			aes_key_hw[i] = (aes_use_hw == AES_HW_BE)? key[15 - i] : key[i];
+		aes_key_mode = aes_use_hw;
+	}
+	reg_aes_ctrl &= ~FLD_AES_CTRL_CODEC_TRIG; // encrypt
+	for (i = 0; i < 16; i++)
+		reg_aes_key(i) = aes_key_hw[i];
+}
+
+/* Wait for a flag of the engine. On timeout the software AES is used
+ * from now on, returns -1 */
+_attribute_ram_code_
+static int aes_hw_wait(uint8_t fld) {
+	uint32_t tt = clock_time();
+	while ((reg_aes_ctrl & fld) == 0) {
+		if (clock_time() - tt > AES_HW_TIMEOUT_US * CLOCK_16M_SYS_TIMER_CLK_1US) {
+			aes_use_hw = AES_HW_OFF;
+			aes_hw_mode = AES_HW_OFF;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Encrypt one block with the key already loaded by aes_hw_set_key().
+ * Returns -1 if the engine does not respond (out is not written) */
+_attribute_ram_code_
+static int aes_hw_block(unsigned char *in, unsigned char *out) {
+	uint8_t i, j, buf[16];
+	if (aes_use_hw == AES_HW_BE) {
+		for (i = 0; i < 16; i++)
+			buf[i] = in[15 - i];
+	} else
+		memcpy(buf, in, 16);
+	for (i = 0; i < 16; i += 4) {
+		if (aes_hw_wait(FLD_AES_CTRL_DATA_FEED))
+			return -1;
+		reg_aes_data = buf[i] | (buf[i + 1] << 8) | (buf[i + 2] << 16) | (buf[i + 3] << 24);
+	}
+	if (aes_hw_wait(FLD_AES_CTRL_CODEC_FINISHED))
+		return -1;
+	for (i = 0; i < 16; i += 4) {
+		uint32_t tmp = reg_aes_data;
+		for (j = 0; j < 4; j++) {
+			buf[i + j] = (uint8_t)tmp;
+			tmp >>= 8;
+		}
+	}
+	if (aes_use_hw == AES_HW_BE) {
+		for (i = 0; i < 16; i++)
+			out[i] = buf[15 - i];
+	} else
+		memcpy(out, buf, 16);
+	return 0;
+}
+
+#define AES_BLOCK(in, out) \
+	if (aes_use_hw == AES_HW_OFF || aes_hw_block(in, out)) \
+		tn_aes_128((u8*)key, in, out)
+
+/*
+ * Cached B0 flags and formatted AAD block.
+ * The layout (nonce/AAD/payload/MIC sizes and the AAD bytes) of
+ * the beacons is fixed, only the nonce contents change per packet.
+ */
+typedef struct {
+	uint8_t iv_len;
+	uint8_t add_len;
+	uint8_t length;
+	uint8_t tag_len;
+	uint8_t b0_flags;
+	uint8_t aad[16];	// formatted AAD block (add_len <= 14)
+} ccm_hdr_t;
+static RAM ccm_hdr_t ccm_hdr;
+
 /*
  * Macros for common operations.
  * Results in smaller compiled code than static inline functions.
@@ -48,7 +149,7 @@
 #define UPDATE_CBC_MAC          \
     for( i = 0; i < 16; i++ )  	\
         y[i] ^= b[i];           \
-    tn_aes_128((u8*)key, y, y);
+    AES_BLOCK(y, y);
 
 /*
  * Encrypt or decrypt a partial block with CTR
@@ -56,14 +157,14 @@
  * This avoids allocating one more 16 bytes buffer while allowing src == dst.
  */
 #define CTR_CRYPT(dst, src, len)	\
-    tn_aes_128((u8*) key, ctr, b);	\
+    AES_BLOCK(ctr, b);				\
     for( i = 0; i < len; i++ )		\
         dst[i] = src[i] ^ b[i];
 
 /*
- * Authenticated encryption or decryption
+ * Authenticated encryption or decryption (blocks)
  */
-static int ccm_auth_crypt( int mode, const unsigned char *key,
+static int ccm_auth_crypt_blk( int mode, const unsigned char *key,
                            const unsigned char *iv, size_t iv_len,
                            const unsigned char *add, size_t add_len,
                            const unsigned char *input, size_t length,
@@ -107,10 +208,26 @@ static int ccm_auth_crypt( int mode, const unsigned char *key,
      * 5 .. 3   (t - 2) / 2
      * 2 .. 0   q - 1
      */
-    b[0] = 0;
-    b[0] |= ( add_len > 0 ) << 6;
-    b[0] |= ( ( tag_len - 2 ) / 2 ) << 3;
-    b[0] |= q - 1;
+    if( add_len > 14 || length > 0xff
+    	|| ccm_hdr.iv_len != iv_len || ccm_hdr.add_len != add_len
+    	|| ccm_hdr.length != length || ccm_hdr.tag_len != tag_len
+    	|| memcmp( ccm_hdr.aad + 2, add, add_len ) )
+    {
+        ccm_hdr.b0_flags = ( ( add_len > 0 ) << 6 )
+        		| ( ( ( tag_len - 2 ) / 2 ) << 3 )
+        		| ( q - 1 );
+        if( add_len <= 14 && length <= 0xff ) {
+            memset( ccm_hdr.aad, 0, 16 );
+            ccm_hdr.aad[1] = (unsigned char) add_len;
+            memcpy( ccm_hdr.aad + 2, add, add_len );
+            ccm_hdr.iv_len = iv_len;
+            ccm_hdr.add_len = add_len;
+            ccm_hdr.length = length;
+            ccm_hdr.tag_len = tag_len;
+        } else
+        	ccm_hdr.iv_len = 0; // not cacheable
+    }
+    b[0] = ccm_hdr.b0_flags;
     memcpy( b + 1, iv, iv_len );
     for( i = 0, len_left = length; i < q; i++, len_left >>= 8 )
         b[15-i] = (unsigned char)( len_left & 0xFF );
@@ -123,7 +240,12 @@ static int ccm_auth_crypt( int mode, const unsigned char *key,
      * If there is additional data, update CBC-MAC with
      * add_len, add, 0 (padding to a block boundary)
      */
-    if( add_len > 0 )
+    if( add_len > 0 && ccm_hdr.iv_len )
+    {
+        memcpy( b, ccm_hdr.aad, 16 );
+        UPDATE_CBC_MAC;
+    }
+    else if( add_len > 0 )
     {
         size_t use_len;
         len_left = add_len;
@@ -206,6 +328,98 @@ static int ccm_auth_crypt( int mode, const unsigned char *key,
     return( 0 );
 }
 
+/*
+ * Authenticated encryption or decryption
+ */
+_attribute_ram_code_
+static int ccm_auth_crypt( int mode, const unsigned char *key,
+                           const unsigned char *iv, size_t iv_len,
+                           const unsigned char *add, size_t add_len,
+                           const unsigned char *input, size_t length,
+                           unsigned char *output,
+                           unsigned char *tag, size_t tag_len )
+{
+    int ret;
+    unsigned char r = 0, hw = aes_use_hw; /* aes_use_hw drops on an engine timeout */
+    if( hw ) {
+        /* the engine is shared with the BLE stack */
+        r = irq_disable();
+        aes_hw_set_key( key );
+    }
+    ret = ccm_auth_crypt_blk( mode, key, iv, iv_len, add, add_len,
+                              input, length, output, tag, tag_len );
+    if( hw )
+        irq_restore( r );
+    return( ret );
+}
+
+/*
+ * Hardware AES check: select the engine byte order or
+ * stay with the software AES if the result does not match.
+ */
+void aes_ccm_init( void )
+{
+    unsigned char key[16], in[16], ref[16], out[16];
+    unsigned char i, r, mode;
+    for( i = 0; i < 16; i++ ) {
+        key[i] = i;
+        in[i] = 0x11 * i;
+    }
+    tn_aes_128( key, in, ref );
+    r = irq_disable();
+    for( mode = AES_HW_LE; mode <= AES_HW_BE; mode++ ) {
+        aes_use_hw = mode;
+        aes_hw_set_key( key );
+        if( aes_hw_block( in, out ) )
+            break; /* no answer, aes_use_hw = AES_HW_OFF */
+        if( memcmp( out, ref, 16 ) == 0 ) {
+            /* the key must stay loaded for the next block */
+            if( aes_hw_block( in, out ) )
+                break;
+            if( memcmp( out, ref, 16 ) == 0 )
+                break;
+        }
+    }
+    irq_restore( r );
+    if( mode > AES_HW_BE )
+        aes_use_hw = AES_HW_OFF;
+    aes_hw_mode = aes_use_hw;
+}
+
+/*
+ * Benchmark: AES-CCM of a Mi beacon sized packet
+ * (12 bytes nonce, 1 byte AAD, 7 bytes payload, 4 bytes MIC),
+ * software and hardware, CPU clocks per packet.
+ */
+#define CCM_BENCH_CNT	16
+void aes_ccm_benchmark( uint32_t *clk_sw, uint32_t *clk_hw )
+{
+    unsigned char key[16], nonce[12], data[7], mic[4];
+    unsigned char aad = 0x11, n;
+    uint32_t tt;
+    memset( key, 0x5a, sizeof(key) );
+    memset( nonce, 0xa5, sizeof(nonce) );
+    memset( data, 0x33, sizeof(data) );
+    *clk_hw = 0;
+    aes_use_hw = AES_HW_OFF;
+    tt = clock_time();
+    for( n = 0; n < CCM_BENCH_CNT; n++ )
+        ccm_auth_crypt( CCM_ENCRYPT, key, nonce, sizeof(nonce), &aad, sizeof(aad),
+                        data, sizeof(data), data, mic, sizeof(mic) );
+    tt = clock_time() - tt;
+    *clk_sw = tt * CLOCK_SYS_CLOCK_1US / CLOCK_16M_SYS_TIMER_CLK_1US / CCM_BENCH_CNT;
+    if( aes_hw_mode ) {
+        aes_use_hw = aes_hw_mode;
+        tt = clock_time();
+        for( n = 0; n < CCM_BENCH_CNT; n++ )
+            ccm_auth_crypt( CCM_ENCRYPT, key, nonce, sizeof(nonce), &aad, sizeof(aad),
+                            data, sizeof(data), data, mic, sizeof(mic) );
+        tt = clock_time() - tt;
+        *clk_hw = tt * CLOCK_SYS_CLOCK_1US / CLOCK_16M_SYS_TIMER_CLK_1US / CCM_BENCH_CNT;
+    }
+    aes_use_hw = aes_hw_mode;
+}
+
 /*
  * Authenticated encryption
  */
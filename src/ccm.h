@@ -83,6 +83,21 @@ int aes_ccm_auth_decrypt( const unsigned char *key,
                       unsigned char *output,
                       const unsigned char *tag, size_t tag_len );
 
+extern uint8_t aes_hw_mode; // 0 - software AES, 1, 2 - hardware AES
+
+/**
+ * \brief           Check the hardware AES engine and select it for CCM
+ */
+void aes_ccm_init( void );
+
+/**
+ * \brief           CCM benchmark (Mi beacon sized packet)
+ *
+ * \param clk_sw    CPU clocks per packet, software AES
+ * \param clk_hw    CPU clocks per packet, hardware AES (0 - not available)
+ */
+void aes_ccm_benchmark( uint32_t *clk_sw, uint32_t *clk_hw );
+
 #ifdef __cplusplus
 }
 #endif
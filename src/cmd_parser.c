@@ -15,17 +15,20 @@
 #endif
 #if USE_MIHOME_BEACON
 #include "mi_beacon.h"
+#include "ccm.h"
 #endif
 #include "cmd_parser.h"
+#include "sensor.h"
 
 #define _flash_read(faddr,len,pbuf) flash_read_page(FLASH_BASE_ADDR + (uint32_t)faddr, len, (uint8_t *)pbuf)
 
-#define TX_MAX_SIZE	 (ATT_MTU_SIZE-3) // = 20
 #define FLASH_MIMAC_ADDR CFG_ADR_MAC // 0x76000
 #define FLASH_MIKEYS_ADDR 0x78000
 //#define FLASH_SECTOR_SIZE 0x1000 // in "flash_eep.h"
 
 RAM uint8_t mi_key_stage;
+RAM uint8_t cmd_pending; // command in progress (CMD_ID_*), 0 - none
+RAM cmd_queue_t cmd_queue;
 RAM uint8_t mi_key_chk_cnt;
 
 enum {
@@ -70,11 +73,12 @@ uint32_t find_mi_keys(uint16_t chk_id, uint8_t cnt) {
 
 uint8_t send_mi_key(void) {
 	if (blc_ll_getTxFifoNumber() < 9) {
-		while(keybuf.klen > TX_MAX_SIZE - 2) {
-			bls_att_pushNotifyData(RxTx_CMD_OUT_DP_H, (u8 *) &keybuf, TX_MAX_SIZE);
-			keybuf.klen -= TX_MAX_SIZE - 2;
+		uint16_t tx_size = ble_tx_size();
+		while(keybuf.klen > tx_size - 2) {
+			bls_att_pushNotifyData(RxTx_CMD_OUT_DP_H, (u8 *) &keybuf, tx_size);
+			keybuf.klen -= tx_size - 2;
 			if(keybuf.klen)
-				memcpy(&keybuf.data, &keybuf.data[TX_MAX_SIZE - 2], keybuf.klen);
+				memcpy(&keybuf.data, &keybuf.data[tx_size - 2], keybuf.klen);
 		};
 		if(keybuf.klen)
 			bls_att_pushNotifyData(RxTx_CMD_OUT_DP_H, (u8 *) &keybuf, keybuf.klen +2);
@@ -216,17 +220,197 @@ static int32_t erase_mikeys(void) {
 	return tmp;
 }
 
-__attribute__((optimize("-Os"))) void cmd_parser(void * p) {
-	rf_packet_att_data_t *req = (rf_packet_att_data_t*) p;
-	uint32_t len = req->l2cap - 3;
+// Answer of CMD_ID_OTA_RESUME: the OTA PDU index to continue from, 0 - start a new OTA
+static void ota_resume_answer(void) {
+	uint16_t index = (ota_resume.state == OTA_RESUME_READY)? ota_resume.index : 0;
+	send_buf[0] = CMD_ID_OTA_RESUME;
+	send_buf[1] = index;
+	send_buf[2] = index >> 8;
+	bls_att_pushNotifyData(RxTx_CMD_OUT_DP_H, send_buf, 3);
+}
+
+// CMD_ID_BATCH: objects to save to Flash
+#define BATCH_SAVE_CFG	0x01
+#define BATCH_SAVE_TRG	0x02
+#define BATCH_SAVE_CMF	0x04
+#define BATCH_SAVE_TIM	0x08
+#define BATCH_SAVE_KEY	0x10
+#define BATCH_SAVE_DVN	0x20
+// CMD_ID_BATCH: answer item len of an item that was not applied (without data)
+#define BATCH_ERR		0xFF
+
+/* CMD_ID_BATCH answer item: [id][len][data], a full notification is sent
+ * and a new one started when the item does not fit into the MTU.
+ * len = BATCH_ERR - [id][BATCH_ERR] item without data */
+static uint32_t batch_add(uint32_t olen, uint8_t id, void * pd, uint32_t len) {
+	uint32_t max = ble_tx_size();
+	if(len != BATCH_ERR && len > max - 3)
+		len = max - 3;
+	if(olen + 2 + ((len == BATCH_ERR)? 0 : len) > max) {
+		bls_att_pushNotifyData(RxTx_CMD_OUT_DP_H, send_buf, olen);
+		olen = 1;
+	}
+	send_buf[olen++] = id;
+	send_buf[olen++] = len;
+	if(len == BATCH_ERR)
+		return olen;
+	memcpy(&send_buf[olen], pd, len);
+	return olen + len;
+}
+
+/* Batch get/set of the settings: [CMD_ID_BATCH]{[id][len][data]}, id - the command
+ * of the object (CMD_ID_CFG, CMD_ID_TRG, ...), len = 0 - get, else set.
+ * Without items, all objects are returned. All the sets are applied first,
+ * then each changed object is saved to Flash once. An item that was not
+ * applied (unknown object, wrong len) is answered as [id][BATCH_ERR],
+ * a malformed tail or the items after the 8th as [id of its first item][BATCH_ERR]. */
+static __attribute__((optimize("-Os"))) uint32_t cmd_batch(uint8_t * dat, uint32_t len) {
+	uint8_t ids[8];
+	uint8_t *dvn = NULL;
+	uint32_t i, n = 0, olen = 1, saves = 0, bad = 0, dvn_len = 0;
+	uint8_t *pd = &dat[1];
+	uint8_t *pend = &dat[len];
+	while(pd + 2 <= pend && pd + 2 + pd[1] <= pend && n < sizeof(ids)) {
+		uint8_t id = pd[0];
+		uint32_t vlen = pd[1];
+		uint8_t *pv = &pd[2];
+		pd += 2 + vlen;
+		ids[n++] = id;
+		if(!vlen)
+			continue;
+		if(id == CMD_ID_CFG) {
+			if(vlen > sizeof(cfg)) vlen = sizeof(cfg);
+			memcpy(&cfg, pv, vlen);
+			test_config_v35(vlen);
+			saves |= BATCH_SAVE_CFG;
+#if USE_TRIGGER_OUT
+		} else if(id == CMD_ID_TRG) {
+			if(vlen > sizeof(trg)) vlen = sizeof(trg);
+			memcpy(&trg, pv, vlen);
+			saves |= BATCH_SAVE_TRG;
+#endif
+		} else if(id == CMD_ID_COMFORT) {
+			if(vlen > sizeof(cmf)) vlen = sizeof(cmf);
+			memcpy(&cmf, pv, vlen);
+			saves |= BATCH_SAVE_CMF;
+#if USE_FLASH_MEMO
+		} else if(id == CMD_ID_UTC_TIME) {
+			if(vlen > sizeof(utc_time_sec)) vlen = sizeof(utc_time_sec);
+			memcpy(&utc_time_sec, pv, vlen);
+#if USE_TIME_ADJUST
+		} else if(id == CMD_ID_TADJUST && vlen >= 2) {
+			utc_time_tick_step = CLOCK_16M_SYS_TIMER_CLK_1S + (int16_t)(pv[0] | (pv[1] << 8));
+			saves |= BATCH_SAVE_TIM;
+#endif
+#endif
+		} else if(id == CMD_ID_DNAME) {
+			if(vlen > sizeof(ble_name) - 2) vlen = sizeof(ble_name) - 2;
+			dvn = pv;
+			dvn_len = (pv[0] != 0)? vlen : 0;
+			saves |= BATCH_SAVE_DVN;
+#if USE_MIHOME_BEACON
+		} else if(id == CMD_ID_BKEY && vlen == sizeof(bindkey)) {
+			memcpy(bindkey, pv, sizeof(bindkey));
+			saves |= BATCH_SAVE_KEY;
+#endif
+		} else // not applied
+			bad |= 1 << (n - 1);
+	}
+	if(n == 0) { // all objects
+		ids[n++] = CMD_ID_CFG;
+#if USE_TRIGGER_OUT
+		ids[n++] = CMD_ID_TRG;
+#endif
+		ids[n++] = CMD_ID_COMFORT;
+#if USE_FLASH_MEMO
+		ids[n++] = CMD_ID_UTC_TIME;
+#if USE_TIME_ADJUST
+		ids[n++] = CMD_ID_TADJUST;
+#endif
+#endif
+		ids[n++] = CMD_ID_DNAME;
+#if USE_MIHOME_BEACON
+		ids[n++] = CMD_ID_BKEY;
+#endif
+	}
+	// one persistence pass
+	if(saves & BATCH_SAVE_CFG) {
+		test_config();
+		ev_adv_timeout(0, 0, 0);
+		flash_write_cfg(&cfg, EEP_ID_CFG, sizeof(cfg));
+	}
+#if USE_TRIGGER_OUT
+	if(saves & BATCH_SAVE_TRG) {
+		trg.flg.sensor_fault = sensor_is_faulty();
+		test_trg_on();
+		flash_write_cfg(&trg, EEP_ID_TRG, FEEP_SAVE_SIZE_TRG);
+	}
+#endif
+	if(saves & BATCH_SAVE_CMF)
+		flash_write_cfg(&cmf, EEP_ID_CMF, sizeof(cmf));
+#if USE_FLASH_MEMO && USE_TIME_ADJUST
+	if(saves & BATCH_SAVE_TIM)
+		flash_write_cfg(&utc_time_tick_step, EEP_ID_TIM, sizeof(utc_time_tick_step));
+#endif
+#if USE_MIHOME_BEACON
+	if(saves & BATCH_SAVE_KEY) {
+		flash_write_cfg(bindkey, EEP_ID_KEY, sizeof(bindkey));
+		mi_beacon_init();
+	}
+#endif
+	if(saves & BATCH_SAVE_DVN) {
+		flash_write_cfg(dvn, EEP_ID_DVN, dvn_len);
+		ble_get_name();
+		ble_connected |= 0x80; // reset device on disconnect
+	}
+	// answer: the current values
+	for(i = 0; i < n; i++) {
+		uint8_t id = ids[i];
+		if(bad & (1 << i))
+			olen = batch_add(olen, id, NULL, BATCH_ERR);
+		else if(id == CMD_ID_CFG)
+			olen = batch_add(olen, id, &cfg, sizeof(cfg));
+#if USE_TRIGGER_OUT
+		else if(id == CMD_ID_TRG)
+			olen = batch_add(olen, id, &trg, sizeof(trg));
+#endif
+		else if(id == CMD_ID_COMFORT)
+			olen = batch_add(olen, id, &cmf, sizeof(cmf));
+#if USE_FLASH_MEMO
+		else if(id == CMD_ID_UTC_TIME)
+			olen = batch_add(olen, id, &utc_time_sec, sizeof(utc_time_sec));
+#if USE_TIME_ADJUST
+		else if(id == CMD_ID_TADJUST)
+			olen = batch_add(olen, id, &utc_time_tick_step, sizeof(utc_time_tick_step));
+#endif
+#endif
+		else if(id == CMD_ID_DNAME)
+			olen = batch_add(olen, id, &ble_name[2], ble_name[0] - 1);
+#if USE_MIHOME_BEACON
+		else if(id == CMD_ID_BKEY) {
+			if(flash_read_cfg(bindkey, EEP_ID_KEY, sizeof(bindkey)) == sizeof(bindkey))
+				olen = batch_add(olen, id, bindkey, sizeof(bindkey));
+			else // No bindkey in EEP!
+				olen = batch_add(olen, id, NULL, 0);
+		}
+#endif
+		else // unknown object
+			olen = batch_add(olen, id, NULL, BATCH_ERR);
+	}
+	if(pd < pend) // malformed or more than 8 items: the rest is not applied
+		olen = batch_add(olen, pd[0], NULL, BATCH_ERR);
+	return olen;
+}
+
+__attribute__((optimize("-Os"))) void cmd_parser(uint8_t * dat, uint32_t len) {
 	if(len) {
-		uint8_t cmd = req->dat[0];
+		uint8_t cmd = dat[0];
 		send_buf[0] = cmd;
 		send_buf[1] = 0; // no err?
 		uint32_t olen = 0;
 		if (cmd == CMD_ID_MEASURE) { // Start/stop notify measures in connection mode
 			if(len >= 2)
-				tx_measures = req->dat[1];
+				tx_measures = dat[1];
 			else {
 				tx_measures = 1;
 			}
@@ -234,7 +418,7 @@ __attribute__((optimize("-Os"))) void cmd_parser(void * p) {
 		} else if (cmd == CMD_ID_EXTDATA) { // Show ext. small and big number
 			if(--len > sizeof(ext)) len = sizeof(ext);
 			if(len) {
-				memcpy(&ext, &req->dat[1], len);
+				memcpy(&ext, &dat[1], len);
 				chow_tick_sec = ext.vtime_sec;
 				chow_tick_clk = clock_time();
 			}
@@ -242,7 +426,8 @@ __attribute__((optimize("-Os"))) void cmd_parser(void * p) {
 		} else if (cmd == CMD_ID_CFG || cmd == CMD_ID_CFG_NS) { // Get/set config
 			if(--len > sizeof(cfg)) len = sizeof(cfg);
 			if(len) {
-				memcpy(&cfg, &req->dat[1], len);
+				memcpy(&cfg, &dat[1], len);
+				test_config_v35(len);
 			}
 			test_config();
 			if (len) {
@@ -261,25 +446,26 @@ __attribute__((optimize("-Os"))) void cmd_parser(void * p) {
 		} else if (cmd == CMD_ID_TRG || cmd == CMD_ID_TRG_NS) { // Get/set trg data
 			if(--len > sizeof(trg))	len = sizeof(trg);
 			if(len)
-				memcpy(&trg, &req->dat[1], len);
+				memcpy(&trg, &dat[1], len);
+			trg.flg.sensor_fault = sensor_is_faulty();
 			test_trg_on();
 			if(cmd != CMD_ID_TRG_NS) // Get/set trg data (not save to Flash)
 				flash_write_cfg(&trg, EEP_ID_TRG, FEEP_SAVE_SIZE_TRG);
 			ble_send_trg();
 		} else if (cmd == CMD_ID_TRG_OUT) { // Set trg out
 			if(len > 1)
-				trg.flg.trg_output = req->dat[1] != 0;
+				trg.flg.trg_output = dat[1] != 0;
 			test_trg_on();
 			ble_send_trg_flg();
 #endif // USE_TRIGGER_OUT
 		} else if (cmd == CMD_ID_DEV_MAC) { // Get/Set mac
-			if(len == 2 && req->dat[1] == 0) { // default MAC
+			if(len == 2 && dat[1] == 0) { // default MAC
 				flash_erase_sector(FLASH_MIMAC_ADDR);
 				blc_initMacAddress(FLASH_MIMAC_ADDR, mac_public, mac_random_static);
 				ble_connected |= 0x80; // reset device on disconnect
-			} else if(len == sizeof(mac_public)+2 && req->dat[1] == sizeof(mac_public)) {
-				if(memcmp(&mac_public, &req->dat[2], sizeof(mac_public))) {
-					memcpy(&mac_public, &req->dat[2], sizeof(mac_public));
+			} else if(len == sizeof(mac_public)+2 && dat[1] == sizeof(mac_public)) {
+				if(memcmp(&mac_public, &dat[2], sizeof(mac_public))) {
+					memcpy(&mac_public, &dat[2], sizeof(mac_public));
 					mac_random_static[0] = mac_public[0];
 					mac_random_static[1] = mac_public[1];
 					mac_random_static[2] = mac_public[2];
@@ -288,16 +474,16 @@ __attribute__((optimize("-Os"))) void cmd_parser(void * p) {
 					blc_newMacAddress(FLASH_MIMAC_ADDR, mac_public, mac_random_static);
 					ble_connected |= 0x80; // reset device on disconnect
 				}
-			} else	if(len == sizeof(mac_public)+2+2 && req->dat[1] == sizeof(mac_public)+2) {
-				if(memcmp(&mac_public, &req->dat[2], sizeof(mac_public))
-						|| mac_random_static[3] != req->dat[2+6]
-						|| mac_random_static[4] != req->dat[2+7] ) {
-					memcpy(&mac_public, &req->dat[2], sizeof(mac_public));
+			} else	if(len == sizeof(mac_public)+2+2 && dat[1] == sizeof(mac_public)+2) {
+				if(memcmp(&mac_public, &dat[2], sizeof(mac_public))
+						|| mac_random_static[3] != dat[2+6]
+						|| mac_random_static[4] != dat[2+7] ) {
+					memcpy(&mac_public, &dat[2], sizeof(mac_public));
 					mac_random_static[0] = mac_public[0];
 					mac_random_static[1] = mac_public[1];
 					mac_random_static[2] = mac_public[2];
-					mac_random_static[3] = req->dat[2+6];
-					mac_random_static[4] = req->dat[2+7];
+					mac_random_static[3] = dat[2+6];
+					mac_random_static[4] = dat[2+7];
 					mac_random_static[5] = 0xC0; 			//for random static
 					blc_newMacAddress(FLASH_MIMAC_ADDR, mac_public, mac_random_static);
 					ble_connected |= 0x80; // reset device on disconnect
@@ -308,7 +494,7 @@ __attribute__((optimize("-Os"))) void cmd_parser(void * p) {
 #if USE_MIHOME_BEACON
 		} else if (cmd == CMD_ID_BKEY) { // Get/set beacon bindkey
 			if(len == sizeof(bindkey) + 1) {
-				memcpy(bindkey, &req->dat[1], sizeof(bindkey));
+				memcpy(bindkey, &dat[1], sizeof(bindkey));
 				flash_write_cfg(bindkey, EEP_ID_KEY, sizeof(bindkey));
 				mi_beacon_init();
 			}
@@ -322,8 +508,12 @@ __attribute__((optimize("-Os"))) void cmd_parser(void * p) {
 #endif
 		} else if (cmd == CMD_ID_MI_KALL) { // Get all mi keys
 			mi_key_stage = get_mi_keys(MI_KEY_STAGE_GET_ALL);
+			if(mi_key_stage)
+				ble_transfer_start(TRANSFER_KEYS);
 		} else if (cmd == CMD_ID_MI_REST) { // Restore prev mi token & bindkeys
 			mi_key_stage = get_mi_keys(MI_KEY_STAGE_RESTORE);
+			if(mi_key_stage)
+				ble_transfer_start(TRANSFER_KEYS);
 			ble_connected |= 0x80; // reset device on disconnect
 		} else if (cmd == CMD_ID_MI_CLR) { // Delete all mi keys
 #if USE_MIHOME_BEACON
@@ -336,20 +526,20 @@ __attribute__((optimize("-Os"))) void cmd_parser(void * p) {
 		} else if (cmd == CMD_ID_LCD_DUMP) { // Get/set lcd buf
 			if(--len > sizeof(display_buff)) len = sizeof(display_buff);
 			if(len) {
-				memcpy(display_buff, &req->dat[1], len);
+				memcpy(display_buff, &dat[1], len);
 				//update_lcd();
 				lcd_flg.b.ext_data = 1;
 			} else lcd_flg.b.ext_data = 0;
 			ble_send_lcd();
 		} else if (cmd == CMD_ID_LCD_FLG) { // Start/stop notify lcd dump and ...
 			 if (len > 1)
-				 lcd_flg.uc = req->dat[1];
+				 lcd_flg.uc = dat[1];
 			 send_buf[1] = lcd_flg.uc;
  			 olen = 2;
 #if BLE_SECURITY_ENABLE
 		} else if (cmd == CMD_ID_PINCODE && len > 4) { // Set new pinCode 0..999999
 			uint32_t old_pincode = pincode;
-			uint32_t new_pincode = req->dat[1] | (req->dat[2]<<8) | (req->dat[3]<<16) | (req->dat[4]<<24);
+			uint32_t new_pincode = dat[1] | (dat[2]<<8) | (dat[3]<<16) | (dat[4]<<24);
 			if(pincode != new_pincode) {
 				pincode = new_pincode;
 				if (flash_write_cfg(&pincode, EEP_ID_PCD, sizeof(pincode))) {
@@ -365,13 +555,13 @@ __attribute__((optimize("-Os"))) void cmd_parser(void * p) {
 		} else if (cmd == CMD_ID_COMFORT) { // Get/set comfort parameters
 			if(--len > sizeof(cfg)) len = sizeof(cmf);
 			if(len)
-				memcpy(&cmf, &req->dat[1], len);
+				memcpy(&cmf, &dat[1], len);
 			flash_write_cfg(&cmf, EEP_ID_CMF, sizeof(cmf));
 			ble_send_cmf();
 		} else if (cmd == CMD_ID_DNAME) { // Get/Set device name
 			if(--len > sizeof(ble_name) - 2) len = sizeof(ble_name) - 2;
 			if(len) {
-				flash_write_cfg(&req->dat[1], EEP_ID_DVN, (req->dat[1] != 0)? len : 0);
+				flash_write_cfg(&dat[1], EEP_ID_DVN, (dat[1] != 0)? len : 0);
 				ble_get_name();
 				ble_connected |= 0x80; // reset device on disconnect
 			}
@@ -379,25 +569,25 @@ __attribute__((optimize("-Os"))) void cmd_parser(void * p) {
 			olen = ble_name[0];
 		} else if (cmd == CMD_ID_MI_DNAME) { // Mi key: DevNameId
 			if(len == MI_KEYDNAME_SIZE + 1)
-				store_mi_keys(MI_KEYDNAME_SIZE, MI_KEYDNAME_ID, &req->dat[1]);
+				store_mi_keys(MI_KEYDNAME_SIZE, MI_KEYDNAME_ID, &dat[1]);
 			get_mi_keys(MI_KEY_STAGE_DNAME);
 			mi_key_stage = MI_KEY_STAGE_WAIT_SEND;
 		} else if (cmd == CMD_ID_MI_TBIND) { // Mi keys: Token & Bind
 			if(len == MI_KEYTBIND_SIZE + 1)
-				store_mi_keys(MI_KEYTBIND_SIZE, MI_KEYTBIND_ID, &req->dat[1]);
+				store_mi_keys(MI_KEYTBIND_SIZE, MI_KEYTBIND_ID, &dat[1]);
 			get_mi_keys(MI_KEY_STAGE_TBIND);
 			mi_key_stage = MI_KEY_STAGE_WAIT_SEND;
 #if USE_FLASH_MEMO
 		} else if (cmd == CMD_ID_UTC_TIME) { // Get/set utc time
 			if(--len > sizeof(utc_time_sec)) len = sizeof(utc_time_sec);
 			if(len)
-				memcpy(&utc_time_sec, &req->dat[1], len);
+				memcpy(&utc_time_sec, &dat[1], len);
 			memcpy(&send_buf[1], &utc_time_sec, sizeof(utc_time_sec));
 			olen = sizeof(utc_time_sec) + 1;
 #if USE_TIME_ADJUST
 		} else if (cmd == CMD_ID_TADJUST) { // Get/set adjust time clock delta (in 1/16 us for 1 sec)
 			if(len > 2) {
-				int16_t delta = req->dat[1] | (req->dat[2] << 8);
+				int16_t delta = dat[1] | (dat[2] << 8);
 				utc_time_tick_step = CLOCK_16M_SYS_TIMER_CLK_1S + delta;
 				flash_write_cfg(&utc_time_tick_step, EEP_ID_TIM, sizeof(utc_time_tick_step));
 			}
@@ -407,25 +597,69 @@ __attribute__((optimize("-Os"))) void cmd_parser(void * p) {
 #endif
 #if USE_FLASH_MEMO
 		} else if (cmd == CMD_ID_LOGGER && len > 2) { // Read memory measures
-			rd_memo.cnt = req->dat[1] | (req->dat[2] << 8);
+			rd_memo.cnt = dat[1] | (dat[2] << 8);
 			if(rd_memo.cnt) {
 				rd_memo.saved = memo;
 				if(len > 4)
-					rd_memo.cur = req->dat[3] | (req->dat[4] << 8);
+					rd_memo.cur = dat[3] | (dat[4] << 8);
 				else
 					rd_memo.cur = 0;
-				bls_pm_setManualLatency(0);
+				ble_transfer_start(TRANSFER_LOG);
 			} else
-				bls_pm_setManualLatency(cfg.connect_latency);
+				ble_transfer_end(TRANSFER_LOG);
 		} else if (cmd == CMD_ID_CLRLOG && len > 2) { // Clear memory measures
-			if(req->dat[1] == 0x12 && req->dat[2] == 0x34) {
-				clear_memo();
-				olen = 2;
+			if(dat[1] == 0x12 && dat[2] == 0x34) {
+				clear_memo(); // the answer is sent by cmd_queue_poll() when the log is cleared
+				cmd_pending = CMD_ID_CLRLOG;
 			}
 #endif
+		} else if (cmd == CMD_ID_SENSOR) { // Get sensor statistics
+			memcpy(&send_buf[1], &sensor_stat, sizeof(sensor_stat));
+			olen = sizeof(sensor_stat) + 1;
+		} else if (cmd == CMD_ID_ADV_STAT) { // Get advertising statistics
+			memcpy(&send_buf[1], &adv_stat, sizeof(adv_stat));
+			olen = sizeof(adv_stat) + 1;
+#if USE_MIHOME_BEACON
+		} else if (cmd == CMD_ID_CCM_BENCH) { // AES-CCM benchmark: mode, CPU clocks software, hardware
+			uint32_t clk_sw, clk_hw;
+			aes_ccm_benchmark(&clk_sw, &clk_hw);
+			send_buf[1] = aes_hw_mode;
+			memcpy(&send_buf[2], &clk_sw, 4);
+			memcpy(&send_buf[6], &clk_hw, 4);
+			olen = 10;
+#endif
+		} else if (cmd == CMD_ID_RSSI) { // Adaptive TX power: [rssi][floor], answer: TX power levels
+			if(len > 1)
+				ble_tx_power_adapt((int8_t)dat[1], (len > 2)? (int8_t)dat[2] : TX_ADAPT_FLOOR);
+			send_buf[1] = tx_power_adv;
+			send_buf[2] = ble_tx_power();
+			olen = 3;
+		} else if (cmd == CMD_ID_TRANSFER) { // Get bulk transfer statistics
+			ble_transfer_poll();
+			ble_send_transfer();
+		} else if (cmd == CMD_ID_OTA_RESUME) { // Resumable OTA: verify the data written
+			if(ota_resume_check())
+				cmd_pending = CMD_ID_OTA_RESUME; // the answer is sent by cmd_queue_poll()
+			else
+				ota_resume_answer();
+		} else if (cmd == CMD_ID_BATCH) { // Batch get/set of the settings
+			olen = cmd_batch(dat, len);
+		} else if (cmd == CMD_ID_PM_STAT) { // Get power management statistics
+			ble_send_pm_stat();
+		} else if (cmd == CMD_ID_NOTIFY_TRG) { // Get/set notification triggers
+			if(len > 2 && ess_trg_set(dat[1], &dat[2], len - 2)) {
+				send_buf[1] = 0xff; // not applied
+				olen = 2;
+			} else {
+				int i;
+				for(i = 0; i < ESS_TRG_NUM; i++) // [condition][operand] x ESS_TRG_NUM
+					memcpy(&send_buf[1 + i * 4], &ess_trg[i], 4);
+				olen = 1 + ESS_TRG_NUM * 4;
+			}
 		} else if (cmd == CMD_ID_MTU && len > 1) { // Request Mtu Size Exchange
-			if(req->dat[1] > ATT_MTU_SIZE)
-				send_buf[1] = blc_att_requestMtuSizeExchange(BLS_CONN_HANDLE, req->dat[1]);
+			if(dat[1] > ATT_MTU_SIZE)
+				send_buf[1] = blc_att_requestMtuSizeExchange(BLS_CONN_HANDLE,
+						(dat[1] < ATT_MTU_MAX_SIZE)? dat[1] : ATT_MTU_MAX_SIZE);
 			else
 				send_buf[1] = 0xff;
 			olen = 2;
@@ -435,12 +669,62 @@ __attribute__((optimize("-Os"))) void cmd_parser(void * p) {
 
 			// Debug commands (unsupported in different versions!):
 
-		} else if (cmd == CMD_ID_DEBUG && len > 3) { // test/debug
-			_flash_read((req->dat[1] | (req->dat[2]<<8) | (req->dat[3]<<16)), 18, &send_buf[4]);
-			memcpy(send_buf, req->dat, 4);
-			olen = 18+4;
+		} else if (cmd == CMD_ID_DEBUG && len > 3) { // test/debug: read flash [addr 3 bytes][size], size up to MTU - 7
+			olen = ble_tx_size() - 4;
+			if(len > 4 && dat[4] && dat[4] < olen)
+				olen = dat[4];
+			_flash_read((dat[1] | (dat[2]<<8) | (dat[3]<<16)), olen, &send_buf[4]);
+			memcpy(send_buf, dat, 4);
+			olen += 4;
 		}
 		if(olen)
 			bls_att_pushNotifyData(RxTx_CMD_OUT_DP_H, send_buf, olen);
 	}
 }
+
+/* Commands written to the RxTx characteristic are queued in the ATT write callback
+ * and executed from main_loop(), one per pass. Long operations continue in steps
+ * (cmd_pending), the queue keeps the next commands meanwhile.
+ * A command that does not fit is dropped with the answer [cmd][CMD_ERR_BUSY]. */
+void cmd_queue_put(uint8_t * dat, uint32_t len) {
+	uint8_t wr = (cmd_queue.wr + 1) & (CMD_QUEUE_CNT - 1);
+	if(wr == cmd_queue.rd) { // full?
+		if(len) {
+			send_buf[0] = dat[0];
+			send_buf[1] = CMD_ERR_BUSY;
+			bls_att_pushNotifyData(RxTx_CMD_OUT_DP_H, send_buf, 2);
+		}
+		return;
+	}
+	if(len > sizeof(cmd_queue.blk[0].dat))
+		len = sizeof(cmd_queue.blk[0].dat);
+	cmd_queue.blk[cmd_queue.wr].len = len;
+	memcpy(cmd_queue.blk[cmd_queue.wr].dat, dat, len);
+	cmd_queue.wr = wr;
+}
+
+// Returns true while commands are queued or pending
+bool cmd_queue_poll(void) {
+	if(blc_ll_getTxFifoNumber() >= 9) // no space for the answer
+		return true;
+	if(cmd_pending) {
+#if USE_FLASH_MEMO
+		if(cmd_pending == CMD_ID_CLRLOG && clear_memo_step())
+			return true;
+#endif
+		if(cmd_pending == CMD_ID_OTA_RESUME) {
+			if(ota_resume_step())
+				return true;
+			ota_resume_answer();
+		} else {
+			send_buf[0] = cmd_pending;
+			send_buf[1] = 0;
+			bls_att_pushNotifyData(RxTx_CMD_OUT_DP_H, send_buf, 2);
+		}
+		cmd_pending = 0;
+	} else if(cmd_queue.rd != cmd_queue.wr) {
+		cmd_parser(cmd_queue.blk[cmd_queue.rd].dat, cmd_queue.blk[cmd_queue.rd].len);
+		cmd_queue.rd = (cmd_queue.rd + 1) & (CMD_QUEUE_CNT - 1);
+	}
+	return cmd_pending || cmd_queue.rd != cmd_queue.wr;
+}
@@ -1,4 +1,5 @@
 #pragma once 
+#include "ble.h"
 enum {
 	CMD_ID_DNAME    = 0x01, // Get/Set device name, "\0" - default: ATC_xxxx
 	CMD_ID_DEV_MAC	= 0x10, // Get/Set MAC [+RandMAC], [size][mac[6][randmac[2]]]
@@ -17,6 +18,15 @@ enum {
 	CMD_ID_MEASURE  = 0x33, // Start/stop notify measures in connection mode
 	CMD_ID_LOGGER   = 0x35, // Read memory measures
 	CMD_ID_CLRLOG	= 0x36, // Clear memory measures
+	CMD_ID_SENSOR	= 0x37, // Get sensor statistics
+	CMD_ID_ADV_STAT	= 0x38, // Get advertising statistics
+	CMD_ID_CCM_BENCH = 0x39, // AES-CCM benchmark
+	CMD_ID_RSSI     = 0x3A, // Adaptive TX power: RSSI of the advertising seen by the gateway
+	CMD_ID_TRANSFER = 0x3B, // Get bulk transfer statistics
+	CMD_ID_OTA_RESUME = 0x3C, // Verify the OTA data written before a link loss, answer: next OTA PDU index
+	CMD_ID_BATCH    = 0x3D, // Batch get/set of the settings, {[id][len][data]}, id: CMD_ID_CFG, CMD_ID_TRG, ...
+	CMD_ID_PM_STAT  = 0x3E, // Get power management statistics of the connection
+	CMD_ID_NOTIFY_TRG = 0x3F, // Get/set notification triggers of 0x2A1F, 0x2A6E, 0x2A6F: [idx][condition][operand]
 	CMD_ID_TRG      = 0x44, // Get/set trg data
 	CMD_ID_TRG_OUT  = 0x45, // Set trg out
 	CMD_ID_TRG_NS   = 0x4A, // Get/set trg data (not save to Flash)
@@ -51,4 +61,18 @@ uint32_t find_mi_keys(uint16_t chk_id, uint8_t cnt);
 uint8_t mi_key_stage;
 uint8_t get_mi_keys(uint8_t chk_stage);
 
-void cmd_parser(void * p);
+#define CMD_QUEUE_CNT	4 // commands in the queue, power of 2 (one entry stays free)
+#define CMD_ERR_BUSY	0xFE // answer [cmd][CMD_ERR_BUSY]: the queue was full, the command is dropped
+typedef struct _cmd_queue_t {
+	uint8_t rd;
+	uint8_t wr;
+	struct {
+		uint8_t len;
+		uint8_t dat[SEND_BUFFER_SIZE]; // max. write size for ATT_MTU_MAX_SIZE
+	} blk[CMD_QUEUE_CNT];
+} cmd_queue_t;
+extern uint8_t cmd_pending;
+
+void cmd_parser(uint8_t * dat, uint32_t len);
+void cmd_queue_put(uint8_t * dat, uint32_t len);
+bool cmd_queue_poll(void);
@@ -11,6 +11,18 @@
 RAM uint32_t chow_tick_clk; // count show validity time, in clock
 RAM uint32_t chow_tick_sec; // count show validity time, in sec
 
+#define DISPLAY_HYST	3 // x0.01, hysteresis of the rounding to the shown x0.1 values
+
+// The last rendered temperature and humidity layout, the same state is not rendered again
+typedef struct __attribute__((packed)) _display_state_t {
+	int16_t		big;	// x0.1 C or F
+	int16_t		small;	// x0.1 %
+	uint8_t		symbol;	// temp symbol, 0 - not rendered
+	uint8_t		battery; // battery symbol shown (this layout does not show the level)
+	uint8_t		ble;	// ble_connected & 0x10
+} display_state_t;
+RAM display_state_t display_state;
+
 static inline bool should_display_ext_data_layout()
 {
 	while (chow_tick_sec && clock_time() - chow_tick_clk
@@ -29,29 +41,53 @@ static inline void display_ext_data_layout(void)
 	display_small_number_x10(ext.small_number, ext.flg.percent_on);
 }
 
+/* Rounds a x0.01 value to x0.1. The shown value is kept while the value
+ * stays within DISPLAY_HYST of its rounding interval, so a value at
+ * the rounding boundary does not flip the display every measurement */
+static _attribute_ram_code_ int16_t display_round_hyst(int32_t value, int16_t shown)
+{
+	int32_t d = value - shown * 10;
+	if (d <= 5 + DISPLAY_HYST && d >= -5 - DISPLAY_HYST)
+		return shown;
+	return (value + ((value < 0) ? -5 : 5)) / 10;
+}
+
 static inline void display_temperature_humidity_layout()
 {
+	display_state_t st;
 	// Show temperature in Fahrenheit or Celsius degrees in the big number
 	bool btn_on_boot = button_was_pressed_on_boot();
 	if (cfg.flg.temp_F_or_C) {
-		display_temp_symbol(btn_on_boot ? TMP_SYM_EQ : TMP_SYM_F);
-		display_big_number_x10((((measured_data.temp / 5) * 9) + 3200) / 10); // convert C to F
+		st.symbol = btn_on_boot ? TMP_SYM_EQ : TMP_SYM_F;
+		st.big = display_round_hyst(((measured_data.temp * 9) / 5) + 3200, display_state.big); // convert C to F
 	} else {
-		display_temp_symbol(btn_on_boot ? TMP_SYM_EQ : TMP_SYM_C);
-		display_big_number_x10(last_temp);
+		st.symbol = btn_on_boot ? TMP_SYM_EQ : TMP_SYM_C;
+		st.big = display_round_hyst(measured_data.temp, display_state.big);
 	}
-	display_battery_symbol(true);
-	display_small_number_x10((measured_data.humi + 5) / 10, 1);
+	st.small = display_round_hyst(measured_data.humi, display_state.small);
+	st.battery = 1;
+	st.ble = ble_connected & 0x10;
+	if (memcmp(&st, &display_state, sizeof(st)) == 0)
+		return; // nothing visible has changed
+	memcpy(&display_state, &st, sizeof(st));
+	lcd_flg.b.new_update = lcd_flg.b.notify_on;
+	display_ble_symbol(st.ble);
+	display_temp_symbol(st.symbol);
+	display_big_number_x10(st.big);
+	display_battery_symbol(st.battery);
+	display_small_number_x10(st.small, 1);
 }
 
 _attribute_ram_code_ void display_update(void)
 {
-	if (lcd_flg.b.ext_data)
+	if (lcd_flg.b.ext_data) {
+		display_state.symbol = 0; // render all after the external buffer
 		return;
-
-	lcd_flg.b.new_update = lcd_flg.b.notify_on;
-	display_ble_symbol(ble_connected & 0x10);
+	}
 	if (should_display_ext_data_layout()) {
+		lcd_flg.b.new_update = lcd_flg.b.notify_on;
+		display_state.symbol = 0;
+		display_ble_symbol(ble_connected & 0x10);
 		display_ext_data_layout();
 	} else {
 		display_temperature_humidity_layout();
@@ -60,6 +96,7 @@ _attribute_ram_code_ void display_update(void)
 
 void display_low_battery_voltage(int battery_mv)
 {
+	display_state.symbol = 0;
 	display_temp_symbol(0);
 	display_big_number_x10(battery_mv * 10);
 	display_small_number_x10(-1023, 1); // Force "Lo" display
@@ -8,17 +8,33 @@
 #include "battery.h"
 #include "drivers/8258/pm.h"
 #include "drivers/8258/timer.h"
+#if USE_EPD_SPI
+#include "drivers/8258/spi.h"
+#endif
 #include "display_drv.h"
 #include "display_13seg_cell.h"
 #include "display_3cell_line.h"
 
-#define DEF_EPD_REFRESH_CNT     32
+/* Full refresh policy: partial refreshes leave ghosting, that grows with
+ * the number of segment toggles and the time, and is worse in the cold.
+ * A full refresh is done before a partial one after EPD_FULL_TOGGLES
+ * toggled segments or EPD_FULL_PERIOD_SEC since the last full refresh,
+ * both halved below 10 °C and quartered below 0 °C. */
+#define EPD_FULL_TOGGLES        400 // visible bits toggled by partial refreshes
+#define EPD_FULL_PERIOD_SEC     7200 // 2 hours
 
-RAM uint8_t display_cmp_buff[18];
+RAM uint8_t display_cmp_buff[DISPLAY_BUFF_LEN];
 RAM uint8_t stage_lcd;
 RAM uint8_t flg_lcd_init;
-RAM uint8_t lcd_refresh_cnt;
 RAM uint8_t epd_updated;
+RAM uint16_t epd_toggles; // visible bits toggled since the last full refresh
+RAM uint32_t epd_full_sec; // utc_time_sec of the last full refresh
+
+// display_buff bits that drive segments, a change of the others is not refreshed
+static const uint8_t epd_visible_mask[DISPLAY_BUFF_LEN] = {
+    0x07, 0xFF, 0xFF, 0xFF, 0xE3, 0xFF, 0xFF, 0xFB, 0xFE,
+    0xFF, 0xF0, 0x00, 0x00, 0x07, 0xFF, 0xFF, 0xF0, 0x00
+};
 //----------------------------------
 // LUTV, LUT_KK and LUT_KW values taken from the actual device with a
 // logic analyzer
@@ -42,6 +58,55 @@ _attribute_ram_code_ static void transmit_bit(bool bit) {
     delay_EPD_SCL_pulse();
 }
 
+#if USE_EPD_SPI
+/* The panel takes 9-bit words (D/C bit + 8 data bits), the SPI master of
+ * the chip only 8-bit frames. The D/C bit is clocked out by the GPIO,
+ * then EPD_SDA and EPD_SCL are switched to the SPI function for the byte.
+ * Word with CSB framing: bit-bang ~92 us, SPI at 1 MHz ~31 us (with ~0.3 us
+ * of the pin switching). The SPI is set up once per refresh (~10 us, the
+ * gpio_set_func() calls run from Flash) and released at its end (~1 us). */
+#define EPD_SPI_DIV	(CLOCK_SYS_CLOCK_HZ / (2 * EPD_SPI_CLK) - 1)
+
+static RAM uint8_t epd_pin_spi_out_en, epd_pin_spi_en; // pad settings before epd_spi_init()
+static RAM uint8_t epd_spi_on; // the SPI is set up for the current refresh
+
+static void epd_spi_init(void) {
+    epd_pin_spi_out_en = reg_pin_i2c_spi_out_en;
+    epd_pin_spi_en = reg_pin_i2c_spi_en;
+    reg_pin_i2c_spi_out_en |= FLD_PIN_PBGROUP_SPI_EN | FLD_PIN_PDGROUP_SPI_EN;
+    reg_pin_i2c_spi_en |= FLD_PIN_PD7_SPI_EN;
+    reg_pin_i2c_spi_en &= ~FLD_PIN_PD7_I2C_EN;
+    gpio_set_func(EPD_SDA, AS_SPI); // set the pin mux
+    gpio_set_func(EPD_SCL, AS_SPI);
+    gpio_set_func(EPD_SDA, AS_GPIO); // the mux stays SPI, the pins are GPIO between the words
+    gpio_set_func(EPD_SCL, AS_GPIO);
+    spi_master_init(EPD_SPI_DIV, SPI_MODE0); // CK idle low, data read at the rising edge
+    reg_spi_ctrl &= ~(FLD_SPI_DATA_OUT_DIS | FLD_SPI_RD);
+    epd_spi_on = 1;
+}
+
+/* At each task_lcd() step: the full setup at the first step of a refresh or
+ * if deep retention has reset the registers, else only the SPI function of
+ * the I2C/SPI block, which i2c_start() takes for the sensor between the steps */
+_attribute_ram_code_ static void epd_spi_step(void) {
+    if (!epd_spi_on || (reg_spi_sp & 0x7f) != EPD_SPI_DIV || !(reg_clk_en0 & FLD_CLK0_SPI_EN))
+        epd_spi_init();
+    else
+        reg_spi_sp |= FLD_SPI_ENABLE;
+}
+
+/* End of the refresh. I2C and SPI masters share one block: return it to I2C for the sensor */
+_attribute_ram_code_ static void epd_spi_end(void) {
+    epd_spi_on = 0;
+    BM_SET(reg_gpio_func(EPD_SCL), EPD_SCL & 0xff); // GPIO
+    BM_SET(reg_gpio_func(EPD_SDA), EPD_SDA & 0xff);
+    reg_spi_sp &= ~FLD_SPI_ENABLE;
+    reg_clk_en0 &= ~FLD_CLK0_SPI_EN;
+    reg_pin_i2c_spi_out_en = epd_pin_spi_out_en;
+    reg_pin_i2c_spi_en = epd_pin_spi_en;
+}
+#endif
+
 _attribute_ram_code_ __attribute__((optimize("-Os"))) static void transmit(bool cd, uint8_t data_to_send) {
     // enable SPI
     gpio_write(EPD_SCL, LOW);
@@ -50,9 +115,19 @@ _attribute_ram_code_ __attribute__((optimize("-Os"))) static void transmit(bool
 
     // send bits
     transmit_bit(cd);
+#if USE_EPD_SPI
+    gpio_write(EPD_SCL, LOW);
+    BM_CLR(reg_gpio_func(EPD_SDA), EPD_SDA & 0xff); // pins to SPI
+    BM_CLR(reg_gpio_func(EPD_SCL), EPD_SCL & 0xff);
+    reg_spi_data = data_to_send;
+    while (reg_spi_ctrl & FLD_SPI_BUSY);
+    BM_SET(reg_gpio_func(EPD_SCL), EPD_SCL & 0xff); // pins to GPIO
+    BM_SET(reg_gpio_func(EPD_SDA), EPD_SDA & 0xff);
+#else
     for (int i = 0x80; i; i >>= 1) {
         transmit_bit(data_to_send & i);
     }
+#endif
 
     // finish by ending the clock cycle and disabling SPI
     gpio_write(EPD_SCL, LOW);
@@ -65,7 +140,8 @@ void display_init(void) {
     // pulse RST_N low for 110 microseconds
     gpio_write(EPD_RST, LOW);
     pm_wait_us(110);
-    lcd_refresh_cnt = DEF_EPD_REFRESH_CNT;
+    epd_toggles = 0;
+    epd_full_sec = utc_time_sec;
     stage_lcd = 1;
     epd_updated = 0;
     flg_lcd_init = 1;
@@ -78,15 +154,44 @@ void display_power_toggle()
     // ePaper does not need to be turned off to save power
 }
 
+/* Counts the visible bits changed since the last refresh */
+_attribute_ram_code_ static uint32_t epd_changed_bits(void) {
+    uint32_t i, x, n = 0;
+    for (i = 0; i < sizeof(display_buff); i++) {
+        x = (display_buff[i] ^ display_cmp_buff[i]) & epd_visible_mask[i];
+        while (x) {
+            x &= x - 1;
+            n++;
+        }
+    }
+    return n;
+}
+
+_attribute_ram_code_ static bool epd_full_refresh_needed(void) {
+    uint32_t toggles = EPD_FULL_TOGGLES, sec = EPD_FULL_PERIOD_SEC;
+    if (last_temp < 100) { // < 10 °C
+        toggles >>= 1;
+        sec >>= 1;
+        if (last_temp < 0) {
+            toggles >>= 1;
+            sec >>= 1;
+        }
+    }
+    return epd_toggles >= toggles || utc_time_sec - epd_full_sec >= sec;
+}
+
 _attribute_ram_code_ void display_async_refresh(void){
     if(!stage_lcd && memcmp(&display_cmp_buff, &display_buff, sizeof(display_buff))) {
+        uint32_t n = epd_changed_bits();
         memcpy(&display_cmp_buff, &display_buff, sizeof(display_buff));
-        if(lcd_refresh_cnt) {
-            lcd_refresh_cnt--;
-            flg_lcd_init = 0;
-            stage_lcd = 1;
-        } else {
-            display_init(); // pulse RST_N low for 110 microseconds
+        if (n) { // skip if only invisible bits have changed
+            epd_toggles += n; // < EPD_FULL_TOGGLES + DISPLAY_BUFF_LEN * 8
+            if (epd_full_refresh_needed()) {
+                display_init(); // pulse RST_N low for 110 microseconds
+            } else {
+                flg_lcd_init = 0;
+                stage_lcd = 1;
+            }
         }
     }
     if (stage_lcd != 0) {
@@ -110,6 +215,9 @@ void display_sync_refresh(void)
 
 _attribute_ram_code_  __attribute__((optimize("-Os"))) int task_lcd(void) {
     if (gpio_read(EPD_BUSY)) {
+#if USE_EPD_SPI
+        epd_spi_step();
+#endif
         switch (stage_lcd) {
         case 1: // Update/Init lcd, stage 1
             // send Charge Pump ON command
@@ -196,6 +304,12 @@ _attribute_ram_code_  __attribute__((optimize("-Os"))) int task_lcd(void) {
         default:
             stage_lcd = 0;
         }
+#if USE_EPD_SPI
+        if (stage_lcd == 0)
+            epd_spi_end();
+        else
+            reg_spi_sp &= ~FLD_SPI_ENABLE; // I2C function until the next step
+#endif
     }
     return stage_lcd;
 }
@@ -25,8 +25,8 @@ _attribute_ram_code_ void i2c_start(uint8_t address)
         reg_i2c_mode |= FLD_I2C_MASTER_EN; //enable master mode
         reg_i2c_mode &= ~FLD_I2C_HOLD_MASTER; // Disable clock stretching for Sensor
         reg_clk_en0 |= FLD_CLK0_I2C_EN;    //enable i2c clock
-        reg_spi_sp  &= ~FLD_SPI_ENABLE;   //force PADs act as I2C; i2c and spi share the hardware of IC
     }
+    reg_spi_sp  &= ~FLD_SPI_ENABLE;   //force PADs act as I2C; i2c and spi share the hardware of IC (the EPD may use SPI)
     reg_i2c_id = address;
     tx_state = 1;
 }
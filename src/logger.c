@@ -38,6 +38,7 @@ RAM summ_data_t summ_data;
 
 RAM memo_inf_t memo;
 RAM memo_rd_t rd_memo;
+RAM uint32_t memo_clr_faddr; // next sector of the log clearing, 0 - none
 
 static uint32_t test_next_memo_sec_addr(uint32_t faddr) {
 	uint32_t mfaddr = faddr;
@@ -114,18 +115,32 @@ __attribute__((optimize("-Os"))) void memo_init(void) {
 	return;
 }
 
+// Write position in the cyclic buffer, in records from the start of the memo area
+uint16_t get_memo_position(void) {
+	return ((memo.faddr - FLASH_ADDR_START_MEMO) / FLASH_SECTOR_SIZE) * MEMO_SEC_RECS + memo.cnt_cur_sec;
+}
+
+/* Clearing of the log runs in steps of one sector erase (clear_memo_step()),
+ * so as not to block the connection for the whole area */
 void clear_memo(void) {
-	uint32_t tmp;
-	uint32_t faddr = FLASH_ADDR_START_MEMO + FLASH_SECTOR_SIZE;
 	memo.cnt_cur_sec = 0;
-	while(faddr < FLASH_ADDR_END_MEMO) {
-		_flash_read(faddr, sizeof(tmp), &tmp);
-		if(tmp != MEMO_SEC_ID)
-			_flash_erase_sector(faddr);
-		faddr += FLASH_SECTOR_SIZE;
+	memo_clr_faddr = FLASH_ADDR_START_MEMO + FLASH_SECTOR_SIZE;
+}
+
+// Returns 1 while the clearing of the log is pending
+unsigned clear_memo_step(void) {
+	uint32_t tmp;
+	while(memo_clr_faddr < FLASH_ADDR_END_MEMO) {
+		_flash_read(memo_clr_faddr, sizeof(tmp), &tmp);
+		memo_clr_faddr += FLASH_SECTOR_SIZE;
+		if(tmp != MEMO_SEC_ID) {
+			_flash_erase_sector(memo_clr_faddr - FLASH_SECTOR_SIZE);
+			return 1;
+		}
 	}
 	memo_sec_init(FLASH_ADDR_START_MEMO);
-	return;
+	memo_clr_faddr = 0;
+	return 0;
 }
 
 _attribute_ram_code_
@@ -162,6 +177,8 @@ _attribute_ram_code_
 __attribute__((optimize("-Os")))
 void write_memo(void) {
 	memo_blk_t mblk;
+	if(memo_clr_faddr) // clearing of the log is pending
+		return;
 	if(cfg.averaging_measurements == 1) {
 		mblk.temp = measured_data.temp;
 		mblk.humi = measured_data.humi;
@@ -36,9 +36,12 @@ typedef struct _memo_head_t {
 
 extern memo_rd_t rd_memo;
 extern memo_inf_t memo;
+extern uint32_t memo_clr_faddr;
 
 void memo_init(void);
 void clear_memo(void);
+unsigned clear_memo_step(void);
+uint16_t get_memo_position(void);
 unsigned get_memo(uint32_t bnum, pmemo_blk_t p);
 void write_memo(void);
 
@@ -102,6 +102,12 @@ typedef struct __attribute__((packed)) _adv_cust_enc_t {
 	uint8_t		mic[4];		//@8..11
 } adv_cust_enc_t, * padv_cust_enc_t;
 
+typedef struct __attribute__((packed)) _adv_hist_enc_t {
+	adv_cust_head_t head;
+	adv_hist_data_t data;   //@5
+	uint8_t		mic[4];		//@23..26
+} adv_hist_enc_t, * padv_hist_enc_t;
+
 /* Encrypted atc beacon structs
  * https://github.com/pvvx/ATC_MiThermometer/issues/94#issuecomment-842846036 */
 typedef struct __attribute__((packed)) _adv_atc_data_t {
@@ -131,7 +137,10 @@ RAM uint32_t adv_mi_cnt = 0xffffffff; // counter of measurement numbers from sen
 RAM uint32_t adv_atc_cnt = 0xffffffff; // counter of measurement numbers from sensors
 RAM uint32_t adv_cust_cnt = 0xffffffff; // counter of measurement numbers from sensors
 //// Buffers
-RAM uint8_t adv_crypt_buf[ADV_BUFFER_SIZE];
+// encrypted payloads, one buffer per format, so that a cached payload is not overwritten by another format
+RAM uint8_t adv_atc_crypt_buf[ADV_BUFFER_SIZE];
+RAM uint8_t adv_cust_crypt_buf[ADV_BUFFER_SIZE];
+RAM uint8_t adv_mi_crypt_buf[ADV_BUFFER_SIZE];
 /// Vars
 typedef struct _mi_beacon_data_t { // out data
 	int16_t temp;	// x0.1 C
@@ -164,6 +173,7 @@ void mi_beacon_init(void) {
 	}
 	memcpy(beacon_nonce.mac, mac_public, 6);
 	beacon_nonce.pid = DEVICE_TYPE;
+	aes_ccm_init();
 }
 
 /* Averaging measurements */
@@ -178,10 +188,10 @@ void mi_beacon_summ(void) {
 /* Create encrypted custom beacon packet
  * https://github.com/pvvx/ATC_MiThermometer/issues/94#issuecomment-842846036 */
 __attribute__((optimize("-Os")))
-void atc_encrypt_beacon(uint32_t cnt) {
+uint8_t * atc_encrypt_beacon(uint32_t cnt) {
 	if(adv_atc_cnt != cnt) { // measurement counter update?
 		adv_atc_cnt = cnt; // new counter
-		padv_atc_enc_t p = (padv_atc_enc_t)&adv_crypt_buf;
+		padv_atc_enc_t p = (padv_atc_enc_t)&adv_atc_crypt_buf;
 		enc_beacon_nonce_t cbn;
 		adv_atc_data_t data;
 		uint8_t aad = 0x11;
@@ -204,44 +214,54 @@ void atc_encrypt_beacon(uint32_t cnt) {
 						   (uint8_t *)&p->data,
 						   p->mic, 4);
 	}
-	memcpy(&adv_buf.data, &adv_crypt_buf, sizeof(adv_atc_enc_t));
+	return adv_atc_crypt_buf;
 }
 
 __attribute__((optimize("-Os")))
-void pvvx_encrypt_beacon(uint32_t cnt) {
+uint8_t * pvvx_encrypt_beacon(uint32_t cnt) {
 	if(adv_cust_cnt != cnt) { // measurement counter update?
 		adv_cust_cnt = cnt; // new counter
-		padv_cust_enc_t p = (padv_cust_enc_t)&adv_crypt_buf;
+		padv_cust_enc_t p = (padv_cust_enc_t)&adv_cust_crypt_buf;
 		enc_beacon_nonce_t cbn;
 		adv_cust_data_t data;
+		adv_hist_data_t hdata;
+		uint8_t * pdata = (uint8_t *)&data;
+		uint8_t dlen = sizeof(data);
 		uint8_t aad = 0x11;
-		p->head.size = sizeof(adv_cust_enc_t) - 1;
-		p->head.uid = GAP_ADTYPE_SERVICE_DATA_UUID_16BIT; // 16-bit UUID
-		p->head.UUID = ADV_CUSTOM_UUID16; // GATT Service 0x181A Environmental Sensing (little-endian) (or 0x181C 'User Data'?)
-		p->head.counter = (uint8_t)cnt;
-		data.temp = measured_data.temp;
-		data.humi = measured_data.humi;
-		data.bat = battery_level;
+		if(cfg.flg2.adv_history) { // custom beacon with the history of readings
+			adv_history_data(&hdata);
+			pdata = (uint8_t *)&hdata;
+			dlen = sizeof(hdata);
+			p->head.size = sizeof(adv_hist_enc_t) - 1;
+		} else {
+			data.temp = measured_data.temp;
+			data.humi = measured_data.humi;
+			data.bat = battery_level;
 #if USE_TRIGGER_OUT
-		data.trg = trg.flg_byte;
+			data.trg = trg.flg_byte;
 #else
-		data.trg = 0;
+			data.trg = 0;
 #endif
+			p->head.size = sizeof(adv_cust_enc_t) - 1;
+		}
+		p->head.uid = GAP_ADTYPE_SERVICE_DATA_UUID_16BIT; // 16-bit UUID
+		p->head.UUID = ADV_CUSTOM_UUID16; // GATT Service 0x181A Environmental Sensing (little-endian) (or 0x181C 'User Data'?)
+		p->head.counter = (uint8_t)cnt;
 		memcpy(&cbn.MAC, mac_public, sizeof(cbn.MAC));
 		memcpy(&cbn.head, p, sizeof(cbn.head));
 		aes_ccm_encrypt_and_tag((const unsigned char *)&bindkey,
 						   (uint8_t*)&cbn, sizeof(cbn),
 						   &aad, sizeof(aad),
-						   (uint8_t *)&data, sizeof(data),
+						   pdata, dlen,
 						   (uint8_t *)&p->data,
-						   p->mic, 4);
+						   (uint8_t *)&p->data + dlen, 4);
 	}
-	memcpy(&adv_buf.data, &adv_crypt_buf, sizeof(adv_cust_enc_t));
+	return adv_cust_crypt_buf;
 }
 
 /* Create encrypted mi beacon packet */
 __attribute__((optimize("-Os")))
-void mi_encrypt_beacon(uint32_t cnt) {
+uint8_t * mi_encrypt_beacon(uint32_t cnt) {
 	if(adv_mi_cnt != cnt) { // measurement counter update?
 		adv_mi_cnt = cnt; // new counter
 		beacon_nonce.cnt32 = cnt;
@@ -251,7 +271,7 @@ void mi_encrypt_beacon(uint32_t cnt) {
 			mi_beacon_data.batt = get_battery_level((uint16_t)(mib_summ_data.batt/mib_summ_data.count));
 			memset(&mib_summ_data, 0, sizeof(mib_summ_data));
 		}
-		padv_mi_struct_data_t p = (padv_mi_struct_data_t)&adv_crypt_buf;
+		padv_mi_struct_data_t p = (padv_mi_struct_data_t)&adv_mi_crypt_buf;
 		p->head.uid = GAP_ADTYPE_SERVICE_DATA_UUID_16BIT; // 16-bit UUID
 		p->head.UUID = ADV_XIAOMI_UUID16; // 16-bit UUID for Members 0xFE95 Xiaomi Inc.
 		p->head.dev_id = beacon_nonce.pid;
@@ -287,7 +307,7 @@ void mi_encrypt_beacon(uint32_t cnt) {
 #endif
 				p->capability = 0x08; // capability
 				p->head.size = sizeof(adv_mi_head_t);
-				return;
+				return adv_mi_crypt_buf;
 		}
 #if 0
 		p->head.fctrl.word = 0;
@@ -323,7 +343,7 @@ void mi_encrypt_beacon(uint32_t cnt) {
 							   pmic, 4);
 #endif
 	}
-	memcpy(&adv_buf.data, &adv_crypt_buf, min(sizeof(adv_crypt_buf), ADV_BUFFER_SIZE));
+	return adv_mi_crypt_buf;
 }
 
 #endif // USE_MIHOME_BEACON
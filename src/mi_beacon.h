@@ -12,10 +12,10 @@ extern uint8_t bindkey[16];
 //extern uint8_t *pbindkey;
 
 void mi_beacon_summ(void); // averaging measurements
-void mi_encrypt_beacon(uint32_t cnt);
+uint8_t * mi_encrypt_beacon(uint32_t cnt);
 void mi_beacon_init(void);
 
-void atc_encrypt_beacon(uint32_t cnt);
-void pvvx_encrypt_beacon(uint32_t cnt);
+uint8_t * atc_encrypt_beacon(uint32_t cnt);
+uint8_t * pvvx_encrypt_beacon(uint32_t cnt);
 
 #endif /* MI_BEACON_H_ */
@@ -1,7 +1,32 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
+
+// Sensor instrumentation counters (CMD_ID_SENSOR)
+typedef struct __attribute__((packed)) _sensor_stat_t {
+	uint32_t	conversions;	// total number of sensor conversions started
+	uint32_t	last_read_us;	// sensor active time of the last reading, in us (energy cost per reading)
+	uint8_t		last_read_conv;	// valid conversions averaged in the last reading
+	uint16_t	crc_errors;		// conversions read back with a CRC mismatch
+	uint16_t	naks;			// read requests not acknowledged by the sensor
+	uint16_t	retries;		// repeated read requests
+	uint16_t	resets;			// sensor soft resets after failed readings
+	uint8_t		fail_cnt;		// consecutive failed readings (0 - sensor OK)
+} sensor_stat_t;
+extern sensor_stat_t sensor_stat;
+
+#define SENSOR_FAULT_CNT	3	// consecutive failed readings that flag a sensor fault
+#define SENSOR_PROBE_MIN_us	1000000 // first re-probe of a faulty sensor, in us
+#define SENSOR_PROBE_MAX_us	(600*1000000) // limit of the re-probe backoff, in us
+
+static inline bool sensor_is_faulty(void) {
+	return sensor_stat.fail_cnt >= SENSOR_FAULT_CNT;
+}
+
 void sensor_init(void);
 void sensor_turn_off(void);
 bool sensor_is_idle(void);
 bool sensor_is_shtc3(void);
 bool sensor_read(void);
+bool sensor_fault_changed(void);
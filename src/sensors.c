@@ -42,6 +42,18 @@ static RAM bool sensor_idle;
 static RAM uint32_t next_awake;
 static RAM uint32_t next_read;
 
+// Burst oversampling: cfg.flg2.oversampling -> 1, 2, 4 or 8 conversions per reading
+static RAM uint8_t conv_pending; // conversions left in the current reading
+static RAM uint8_t conv_valid; // valid conversions accumulated in the current reading
+static RAM uint32_t sum_temp; // raw temperature accumulator
+static RAM uint32_t sum_humi; // raw humidity accumulator
+static RAM utime_t conv_start; // uclock time of the last start_measurement()
+static RAM uint32_t read_busy_us; // sensor active time of the current reading
+static RAM uint32_t probe_delay_us; // current re-probe backoff of a faulty sensor
+static RAM bool fault_flg; // last reported sensor fault state
+
+RAM sensor_stat_t sensor_stat;
+
 static inline uint32_t get_read_interval_us()
 {
 	 // cfg.advertising_interval is configured in units of 62.5 ms
@@ -90,17 +102,35 @@ bool sensor_is_shtc3()
 	return is_shtc3();
 }
 
-void sensor_init()
+static void sensor_wakeup_reset(void)
 {
-	next_read = next_awake = uclock_awake_after(0);
 	if (is_shtc3()) {
 		i2c_write_tx_1word(sensor_i2c_addr, SHTC3_WAKEUP); //	Wake-up command of the sensor
 		sleep_us(SHTC3_WAKEUP_us);	// 240 us
 	}
 	sensor_reset();
+}
+
+void sensor_init()
+{
+	next_read = next_awake = uclock_awake_after(0);
+	probe_delay_us = SENSOR_PROBE_MIN_us;
+	sensor_wakeup_reset();
 	sensor_idle = true;
 }
 
+// Re-detects a faulty sensor on the bus and restarts it
+static bool sensor_probe(void)
+{
+	sensor_i2c_addr = 0;
+	sensor_is_shtc3();
+	if (!sensor_i2c_addr)
+		return false;
+	sensor_stat.resets++;
+	sensor_wakeup_reset();
+	return true;
+}
+
 static _attribute_ram_code_ u8 update_crc8(u8 data, u8 crc)
 {
 	crc ^= data;
@@ -141,36 +171,55 @@ static _attribute_ram_code_ bool read_sensor_cb(void)
 	reg_i2c_id = sensor_i2c_addr | FLD_I2C_WRITE_READ_BIT;
 
 	for (int retries = 0; retries < 5; ++retries) {
+		if (retries)
+			sensor_stat.retries++;
 		reg_i2c_ctrl = FLD_I2C_CMD_ID | FLD_I2C_CMD_START;
 		while(reg_i2c_status & FLD_I2C_CMD_BUSY);
 
 		uint16_t _temp;
 		uint16_t _humi;
-		bool valid = !(reg_i2c_status & FLD_I2C_NAK) && read_word(&_temp) && _temp != 0xffff && read_word(&_humi);
+		bool valid = false;
+		if (reg_i2c_status & FLD_I2C_NAK)
+			sensor_stat.naks++;
+		else if (read_word(&_temp) && _temp != 0xffff && read_word(&_humi))
+			valid = true;
+		else
+			sensor_stat.crc_errors++;
 
 		reg_i2c_ctrl = FLD_I2C_CMD_STOP;
 		while(reg_i2c_status & FLD_I2C_CMD_BUSY);
 
 		if (valid) {
-			measured_data.temp = ((int32_t)(17500*_temp) >> 16) - 4500 + cfg.temp_offset * 10; // x 0.01 C
-			if (is_shtc3())
-				measured_data.humi = ((uint32_t)(10000*_humi) >> 16) + cfg.humi_offset * 10; // x 0.01 %
-			else
-				measured_data.humi = ((uint32_t)(12500*_humi) >> 16) - 600 + cfg.humi_offset * 10; // x 0.01 %
-			if (measured_data.humi < 0)
-				measured_data.humi = 0;
-			else if(measured_data.humi > 9999)
-				measured_data.humi = 9999;
-			measured_data.count++;
+			sum_temp += _temp;
+			sum_humi += _humi;
+			conv_valid++;
 			if (is_shtc3())
 				i2c_write_tx_1word(sensor_i2c_addr, SHTC3_GO_SLEEP); // Sleep command of the sensor
 			return true;
 		}
 	}
+	sensor_stat.resets++;
 	sensor_reset();
 	return false;
 }
 
+// Averages the accumulated conversions (decimation) and updates measured_data
+static _attribute_ram_code_ void update_measured_data(void)
+{
+	uint16_t _temp = (sum_temp + (conv_valid >> 1)) / conv_valid;
+	uint16_t _humi = (sum_humi + (conv_valid >> 1)) / conv_valid;
+	measured_data.temp = ((int32_t)(17500*_temp) >> 16) - 4500 + cfg.temp_offset * 10; // x 0.01 C
+	if (is_shtc3())
+		measured_data.humi = ((uint32_t)(10000*_humi) >> 16) + cfg.humi_offset * 10; // x 0.01 %
+	else
+		measured_data.humi = ((uint32_t)(12500*_humi) >> 16) - 600 + cfg.humi_offset * 10; // x 0.01 %
+	if (measured_data.humi < 0)
+		measured_data.humi = 0;
+	else if(measured_data.humi > 9999)
+		measured_data.humi = 9999;
+	measured_data.count++;
+}
+
 static _attribute_ram_code_ void start_measurement(void)
 {
 	if (is_shtc3()) {
@@ -180,6 +229,8 @@ static _attribute_ram_code_ void start_measurement(void)
 	} else if (is_sht4x()) {
 		i2c_write_tx_1byte(sensor_i2c_addr, SHT4x_MEASURE_HI);
 	}
+	conv_start = uclock_time();
+	sensor_stat.conversions++;
 	gpio_setup_up_down_resistor(I2C_SCL, PM_PIN_PULLUP_1M);
 	gpio_setup_up_down_resistor(I2C_SDA, PM_PIN_PULLUP_1M);
 }
@@ -189,6 +240,36 @@ _attribute_ram_code_ bool sensor_is_idle()
 	return sensor_idle;
 }
 
+// Returns true once after the sensor fault state has changed
+bool sensor_fault_changed(void)
+{
+	if (fault_flg == sensor_is_faulty())
+		return false;
+	fault_flg = !fault_flg;
+	return true;
+}
+
+// Counts failed readings and schedules the next one,
+// a faulty sensor is re-probed with an exponential backoff
+static _attribute_ram_code_ void schedule_next_read(bool ok)
+{
+	if (ok) {
+		sensor_stat.fail_cnt = 0;
+		probe_delay_us = SENSOR_PROBE_MIN_us;
+	} else if (sensor_stat.fail_cnt < 0xff)
+		sensor_stat.fail_cnt++;
+	if (sensor_is_faulty()) {
+		next_read = uclock_time() + probe_delay_us;
+		next_awake = uclock_awake_at(next_read);
+		if (probe_delay_us < SENSOR_PROBE_MAX_us)
+			probe_delay_us <<= 1;
+	} else
+		next_awake = uclock_awake_at(next_read += get_read_interval_us());
+#if USE_TRIGGER_OUT
+	trg.flg.sensor_fault = sensor_is_faulty();
+#endif
+}
+
 _attribute_ram_code_ bool sensor_read()
 {
 	if (!uclock_should_awake(next_awake)) {
@@ -196,16 +277,39 @@ _attribute_ram_code_ bool sensor_read()
 	}
 	bool result = false;
 	if (sensor_idle) {
+		if (sensor_is_faulty() && !sensor_probe()) {
+			schedule_next_read(false);
+			return false;
+		}
 		sensor_idle = false;
+		conv_pending = 1 << cfg.flg2.oversampling;
+		conv_valid = 0;
+		sum_temp = 0;
+		sum_humi = 0;
+		read_busy_us = 0;
 		start_measurement();
 		next_awake = uclock_awake_after(SENSOR_MEASURING_TIMEOUT_ms * 1000);
 		check_battery();
 	} else {
-		sensor_idle = true;
 #if USE_TRIGGER_OUT && defined(GPIO_RDS)
 		rds_input_on();
 #endif
-		if (read_sensor_cb()) {
+		bool valid = read_sensor_cb();
+		read_busy_us += uclock_time() - conv_start;
+		if (valid && --conv_pending) {
+			// Next back-to-back conversion of the burst
+#if USE_TRIGGER_OUT && defined(GPIO_RDS)
+			rds_input_off();
+#endif
+			start_measurement();
+			next_awake = uclock_awake_after(SENSOR_MEASURING_TIMEOUT_ms * 1000);
+			return false;
+		}
+		sensor_idle = true;
+		sensor_stat.last_read_us = read_busy_us;
+		sensor_stat.last_read_conv = conv_valid;
+		if (conv_valid) {
+			update_measured_data();
 			result = true;
 #if USE_TRIGGER_OUT
 			set_trigger_out();
@@ -218,7 +322,7 @@ _attribute_ram_code_ bool sensor_read()
 #if USE_TRIGGER_OUT && defined(GPIO_RDS)
 		rds_input_off();
 #endif
-		next_awake = uclock_awake_at(next_read += get_read_interval_us());
+		schedule_next_read(conv_valid != 0);
 	}
 	return result;
 }
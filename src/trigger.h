@@ -17,6 +17,7 @@ typedef struct __attribute__((packed)) _trigger_flg_t {
 	uint8_t 	trigger_on	:	1; // Output GPIO_TRG pin is controlled according to the set parameters threshold temperature or humidity
 	uint8_t 	temp_out_on :	1; // Temperature trigger event
 	uint8_t 	humi_out_on :	1; // Humidity trigger event
+	uint8_t 	sensor_fault :	1; // Sensor does not respond (see CMD_ID_SENSOR)
 }trigger_flg_t;
 
 typedef struct __attribute__((packed)) _trigger_t {
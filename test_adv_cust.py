@@ -17,6 +17,14 @@ def parse_value(hexvalue):
 		(temp, humi, batt, trg) = struct.unpack("<hHBB", hexvalue)
 		print("Temperature:", temp/100, "Humidity:", humi/100, "Battery:", batt, "Trg:", trg)
 		return 1
+	if vlength == 18:
+		(temp, humi, batt, trg) = struct.unpack("<hHBB", hexvalue[:6])
+		print("Temperature:", temp/100, "Humidity:", humi/100, "Battery:", batt, "Trg:", trg)
+		hist = struct.unpack("<12b", hexvalue[6:])
+		for i in range(6):
+			if hist[i*2] != -128:
+				print("History[-%d]: Temperature:" % (i + 1), round(temp/100 + hist[i*2]/10, 2), "Humidity:", round(humi/100 + hist[i*2+1]/2, 2))
+		return 1
 	print("MsgLength:", vlength, "HexValue:", hexvalue.hex())
 	return None
 
@@ -109,6 +117,20 @@ def main():
 	print("AdStruct:", adstruct.hex())
 	decrypt_aes_ccm(binkey, mac, adstruct);
 
+	print()
+	print("====== Test3 PVVX history encode ----------------------------------------")
+	data = struct.pack("<hHBB12b", int(temp*100), int(humi*100), batt, trg, -3, 2, -5, 4, -8, 5, -128, -128, -128, -128, -128, -128)
+	adshead = struct.pack(">BBHB", len(data) + 8, 0x16, 0x1a18, 0xbd) # ad struct head: len, id, uuid16, cnt
+	beacon_nonce = b"".join([mac, adshead])
+	cipher = AES.new(binkey, AES.MODE_CCM, nonce=beacon_nonce, mac_len=4)
+	cipher.update(b"\x11")
+	ciphertext, mic = cipher.encrypt_and_digest(data)
+	adstruct = b"".join([adshead, ciphertext, mic])
+	print("AdStruct:", adstruct.hex())
+	print()
+	print("====== Test3 PVVX history decode ----------------------------------------")
+	decrypt_aes_ccm(binkey, mac, adstruct);
+
 
 if __name__ == '__main__':
 	main()